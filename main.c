@@ -56,18 +56,20 @@ void USB_interrupt(void);
 void USB_ISR(void) __interrupt(INT_NO_USB) {
   USB_interrupt();
 }
+#ifndef ASM_TIMER_ISR // else in assembly, see irs.c
 /** @brief Timer0 Interrupt routine */
-void timer0_interrupt(void) __interrupt(INT_NO_TMR0)   
+void timer0_interrupt(void) __interrupt(INT_NO_TMR0) __using(TX_ISR_BANK)
 { 
   timer0_int_callback(); 
 }
 /** @brief Timer1 Interrupt routine */
-void timer1_interrupt(void) __interrupt(INT_NO_TMR1)   
+void timer1_interrupt(void) __interrupt(INT_NO_TMR1) __using(T1_ISR_BANK)
 { 
   timer1_int_callback(); 
 }
+#endif
 /** Timer 2 Interrupt Service Routine (Vector 5) */
-void Timer2_ISR(void) __interrupt (INT_NO_TMR2) {
+void Timer2_ISR(void) __interrupt (INT_NO_TMR2) __using(T1_ISR_BANK) {
   timer2_int_callback(); 
 }
 
@@ -141,6 +143,13 @@ void main(void) {
   // Setup the timer0 Gated by Int0, when int0 becomes high, timer is started
   TMOD |= bT0_M0 | bT1_M0;   /* Run in time mode not counting */ 
   T2MOD = bT1_CLK; /* Divide the system clock by 12 */
+  #ifdef TX_PRIO_HIGH
+  // Only the TX edge timer is high priority, a late edge is a timing error on air,
+  // while USB, the soft PWM and the RX capture can wait a few microseconds
+  IP = 0;
+  IP_EX = 0;
+  PT0 = 1;
+  #endif
   EA  = 1;     /* Enable global interrupt */
   EX0 = 1;    // Enable INT0
   /** INT0 is edge triggered */
@@ -172,6 +181,10 @@ void main(void) {
               case 'v':// Acquire Version
                   GetUsbIrdroidVersion();
                   break;
+              case 'I':
+              case 'i':// Device information and features
+                  GetUsbIrdroidInfo();
+                  break;
               default:
                 break;         
         }
@@ -10,10 +10,14 @@
 #define PIN_PWM             P34       // PWM pin
 #define IRRX P32                      // IR Receive Pin
 #define SOFT_PWM_MIN_PER    0.000000167F// minimum timer tick for soft PWM
-#define SOFT_PWM
-#define SPWM_DRIFT          35        // We observe 3us PWM Drift, this is correction constant
+#define SOFT_PWM                      // Timer1 soft PWM carrier, exact frequency
+#define HW_PWM                        // PWM2 module carrier, no interrupts, Fsys/256/N steps
+#define SPWM_DRIFT          35        // We observe 3us PWM Drift, this is correction constant (C Timer1 callback)
 #define IRTOY_FREQ 48000000           // Irtoy Xtal frequency
 #define IRTOY_MULTIPLIER 16           // Irtoy multiplier for the Xtal
+#define TX_PRIO_HIGH                  // Timer0 (TX edges) preempts the USB, Timer1 and Timer2 IRQs
+//#define TX_ASM_KERNEL               // TX conversion in assembly (txKernel), once "make bench" shows no mismatch
+//#define ASM_ISR                     // Timer0 and Timer1 routines in assembly, once they are checked on the device
 
 #ifdef SOFT_PWM
 #define PWM_FREQ            38000     // PWM Carrier is 38KHz
@@ -0,0 +1,63 @@
+// ===================================================================================
+// IR signal library for the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// The slots are programmed a word at a time through the flash-ROM IAP registers,
+// and read back directly as code memory.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+// Libraries, Definitions and Macros
+// ===================================================================================
+#include "irlib.h"
+#include "ch554.h"
+
+#define IRLIB_SLOT_PTR(n) ((__code IRLIB_SLOT *)(IRLIB_ADDR + (uint16_t)(n) * IRLIB_SLOT_SIZE))
+
+static __idata uint16_t writeAddr;      // flash address of the next word to write
+static __idata uint16_t writeEnd;       // end of the open slot
+
+// ===================================================================================
+// Function definitions
+// ===================================================================================
+
+__code IRLIB_SLOT *irlibGet(uint8_t slot){
+    __code IRLIB_SLOT *s;
+
+    if (slot >= IRLIB_SLOTS) return NULL;
+    s = IRLIB_SLOT_PTR(slot);
+    if (s->edges == 0 || s->edges > IRLIB_SLOT_EDGES) return NULL;
+    return s;
+}
+
+bool irlibOpen(uint8_t slot){
+    if (slot >= IRLIB_SLOTS) return false;
+    writeAddr = (uint16_t)IRLIB_SLOT_PTR(slot);
+    writeEnd = writeAddr + IRLIB_SLOT_SIZE;
+    SAFE_MOD = 0x55;
+    SAFE_MOD = 0xAA;                    // enter safe mode
+    GLOBAL_CFG |= bCODE_WE;             // enable code flash writes
+    SAFE_MOD = 0;                       // leave safe mode
+    return true;
+}
+
+bool irlibWrite(uint16_t word){
+    if (writeAddr >= writeEnd) return false;
+    ROM_ADDR_H = writeAddr >> 8;
+    ROM_ADDR_L = writeAddr;
+    ROM_DATA_H = word >> 8;
+    ROM_DATA_L = word;
+    if (ROM_STATUS & bROM_ADDR_OK) {    // the address is valid
+        ROM_CTRL = ROM_CMD_WRITE;       // program the word
+    }
+    if (*(__code uint16_t *)writeAddr != word) return false;
+    writeAddr += 2;
+    return true;
+}
+
+void irlibClose(void){
+    SAFE_MOD = 0x55;
+    SAFE_MOD = 0xAA;                    // enter safe mode
+    GLOBAL_CFG &= ~bCODE_WE;            // write protect the code flash
+    SAFE_MOD = 0;                       // leave safe mode
+}
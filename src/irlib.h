@@ -0,0 +1,71 @@
+// ===================================================================================
+// IR signal library for the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// Keeps ready to send IR codes in the unused code flash, above the firmware. A
+// slot holds the Timer0 reload values of a frame, already aligned and two's
+// complemented exactly as they are queued in the transmit ring, so replaying a
+// slot needs no USB payload and no conversion.
+//
+// Command (IRIO_LIB_STORE) [slot]: store the last transmitted frame in the slot,
+// answers 'C' (stored) or 'F' (failed).
+// Command (IRIO_LIB_PLAY | slot): transmit the slot, a single byte.
+//
+// The slots are written by IAP, flashing a new firmware with the bootloader
+// erases them.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// ===================================================================================
+// Definitions and Macros
+// ===================================================================================
+/** The library takes the code flash from IRLIB_ADDR up to the bootloader at
+ * 0x3800, CODE_SIZE in the makefile must stay below it. */
+#define IRLIB_ADDR          0x2800
+#define IRLIB_SLOTS         16
+#define IRLIB_SLOT_MASK     (IRLIB_SLOTS - 1)
+#define IRLIB_SLOT_SIZE     256
+/** Edges (reload values) per slot, the rest of the slot is the header */
+#define IRLIB_SLOT_EDGES    ((IRLIB_SLOT_SIZE - 4) / 2)
+
+/** @brief A library slot in the code flash. The reload values are stored 
+ * little endian, TL0 first. */
+typedef struct {
+    uint8_t edges;                      // number of reload values, 0 or 0xFF if empty
+    uint8_t flags;                      // reserved, 0
+    uint16_t carrier;                   // carrier frequency in Hz
+    uint16_t reload[IRLIB_SLOT_EDGES];  // Timer0 reload values
+} IRLIB_SLOT;
+
+// ===================================================================================
+// Function declarations
+// ===================================================================================
+
+/** @brief Get a library slot
+ *
+ * @param[in] slot - the slot number
+ * @return the slot, NULL if it is empty
+ */
+__code IRLIB_SLOT *irlibGet(uint8_t slot);
+
+/** @brief Unlock the code flash and start writing a slot from its first word
+ *
+ * @param[in] slot - the slot number
+ * @return false if there is no such slot
+ */
+bool irlibOpen(uint8_t slot);
+
+/** @brief Program the next word of the slot opened by irlibOpen()
+ *
+ * @param[in] word - the word to write
+ * @return false if the write failed (the word does not read back)
+ */
+bool irlibWrite(uint16_t word);
+
+/** @brief Write protect the code flash again */
+void irlibClose(void);
@@ -0,0 +1,504 @@
+// ===================================================================================
+// IR protocol synthesizer for the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// The timing templates live in the code flash, the frames are generated edge by
+// edge straight into the Timer0 transmit ring.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+// Libraries, Definitions and Macros
+// ===================================================================================
+#include "irproto.h"
+#include "irs.h"
+
+/** Convert microseconds to Timer0 ticks at compile time */
+#define IRPROTO_US(us)      ((uint16_t)((us) * TIMER_0_TICKS_PER_US))
+
+#define IRPROTO_MSB_FIRST       0x01    // bits go out MSB first (LSB first if not set)
+#define IRPROTO_ONE_SPACE_FIRST 0x02    // a "1" bit starts with the space (RC5)
+#define IRPROTO_ZERO_SPACE_FIRST 0x04   // a "0" bit starts with the space (RC6)
+#define IRPROTO_RC6_TRAILER     0x08    // bit 4 is the double length RC6 trailer bit
+
+/** @brief Timing template of an IR protocol, all times in Timer0 ticks. A bit
+ * is sent as a mark of the first length followed by a space of the second
+ * length, unless the *_SPACE_FIRST flag swaps them (bi-phase coding). */
+typedef struct {
+    uint16_t carrier;       // carrier frequency in Hz
+    uint16_t hdr_mark;      // leader mark, 0 if the protocol has no leader
+    uint16_t hdr_space;     // leader space
+    uint16_t one_a;         // first half of a "1" bit
+    uint16_t one_b;         // second half of a "1" bit
+    uint16_t zero_a;        // first half of a "0" bit
+    uint16_t zero_b;        // second half of a "0" bit
+    uint16_t trail_mark;    // stop mark after the last bit, 0 if none
+    uint16_t period;        // frame repetition period in 0.1ms units
+    uint8_t flags;          // IRPROTO_* coding flags
+} IRPROTO_TIMING;
+
+/** Timing templates, indexed by the protocol ID - 1 */
+static __code IRPROTO_TIMING irprotoTiming[IRPROTO_LAST] = {
+    {   // IRPROTO_NEC
+        38000, IRPROTO_US(9000), IRPROTO_US(4500),
+        IRPROTO_US(560), IRPROTO_US(1690), IRPROTO_US(560), IRPROTO_US(560),
+        IRPROTO_US(560), 1080, 0
+    },
+    {   // IRPROTO_RC5
+        36000, 0, 0,
+        IRPROTO_US(889), IRPROTO_US(889), IRPROTO_US(889), IRPROTO_US(889),
+        0, 1138, IRPROTO_MSB_FIRST | IRPROTO_ONE_SPACE_FIRST
+    },
+    {   // IRPROTO_RC6
+        36000, IRPROTO_US(2666), IRPROTO_US(889),
+        IRPROTO_US(444), IRPROTO_US(444), IRPROTO_US(444), IRPROTO_US(444),
+        0, 1067, IRPROTO_MSB_FIRST | IRPROTO_ZERO_SPACE_FIRST | IRPROTO_RC6_TRAILER
+    },
+    {   // IRPROTO_SONY
+        40000, IRPROTO_US(2400), IRPROTO_US(600),
+        IRPROTO_US(1200), IRPROTO_US(600), IRPROTO_US(600), IRPROTO_US(600),
+        0, 450, 0
+    },
+    {   // IRPROTO_SAMSUNG
+        38000, IRPROTO_US(4500), IRPROTO_US(4500),
+        IRPROTO_US(560), IRPROTO_US(1690), IRPROTO_US(560), IRPROTO_US(560),
+        IRPROTO_US(560), 1080, 0
+    },
+};
+
+/** The NEC repeat frame, sent instead of the full frame for the repeats */
+static __code IRPROTO_TIMING irprotoNecRepeat = {
+    38000, IRPROTO_US(9000), IRPROTO_US(2250),
+    0, 0, 0, 0,
+    IRPROTO_US(560), 1080, 0
+};
+
+static __code IRPROTO_TIMING *pTiming;  // template of the code being sent
+static __idata uint32_t frameCode;      // the bits of the frame
+static uint8_t frameBits;               // number of bits in the frame
+static uint8_t framesLeft;              // frames still to be queued
+static __bit frameRepeat;               // the next frame is a repeat
+static __bit rcToggle;                  // RC5/RC6 toggle bit, flips per new code
+
+static __idata uint16_t emTicks;        // length of the pending edge
+static __idata uint32_t emTotal;        // length of the frame so far
+static __bit emMark;                    // the pending edge is a mark
+
+// ===================================================================================
+// Function definitions
+// ===================================================================================
+
+/** @brief Add a mark or a space to the frame. Consecutive marks or spaces
+ *  (bi-phase coding) are merged into a single edge of the ring, a space at
+ *  the start of the frame is dropped.
+ *
+ * @param[in] mark - true for a mark, false for a space
+ * @param[in] ticks - the length in Timer0 ticks
+ */
+static void irprotoEmit(bool mark, uint16_t ticks){
+    if (mark != emMark) {
+        if (emTicks) irsTxQueue(emTicks);
+        else if (!mark) return;         // leading space
+        emMark = mark;
+        emTicks = 0;
+    }
+    emTicks += ticks;
+    emTotal += ticks;
+}
+
+uint16_t irprotoSetup(uint8_t *param){
+    uint8_t proto = param[0];
+    uint16_t addr = ((uint16_t)param[1] << 8) | param[2];
+    uint8_t cmd = param[3];
+
+    if (proto == 0 || proto > IRPROTO_LAST) return 0;
+    pTiming = &irprotoTiming[proto - 1];
+    framesLeft = param[4] + 1;
+    frameRepeat = 0;
+
+    switch (proto) {
+        case IRPROTO_NEC:       // LSB first: address, ~address (or high byte), command, ~command
+        case IRPROTO_SAMSUNG:   // LSB first: address, address (or high byte), command, ~command
+            frameCode = (uint8_t)addr;
+            if (addr > 0xff) frameCode |= addr & 0xff00;
+            else if (proto == IRPROTO_NEC) frameCode |= (uint16_t)(~addr << 8) & 0xff00;
+            else frameCode |= addr << 8;
+            frameCode |= (uint32_t)cmd << 16;
+            frameCode |= (uint32_t)(uint8_t)~cmd << 24;
+            frameBits = 32;
+            break;
+        case IRPROTO_SONY:      // LSB first: 7 bit command, 5/8/13 bit address
+            frameCode = (cmd & 0x7f) | ((uint32_t)addr << 7);
+            frameBits = addr < 0x20 ? 12 : (addr < 0x100 ? 15 : 20);
+            break;
+        case IRPROTO_RC5:       // MSB first: 1, ~command bit 6, toggle, 5 bit address, 6 bit command
+            rcToggle = !rcToggle;
+            frameCode = 0x2000 | ((cmd & 0x40) ? 0 : 0x1000) | (rcToggle ? 0x0800 : 0)
+                      | ((addr & 0x1f) << 6) | (cmd & 0x3f);
+            frameBits = 14;
+            break;
+        case IRPROTO_RC6:       // MSB first: start bit 1, mode 000, toggle, address, command
+            rcToggle = !rcToggle;
+            frameCode = 0x100000 | (rcToggle ? 0x10000 : 0) | ((addr & 0xff) << 8) | cmd;
+            frameBits = 21;
+            break;
+    }
+    return pTiming->carrier;
+}
+
+bool irprotoFrame(void){
+    __code IRPROTO_TIMING *t = pTiming;
+    uint32_t code = frameCode;
+    uint32_t msb, gap;
+    uint8_t i, bits = frameBits;
+    uint16_t a, b;
+    bool one, spaceFirst;
+
+    if (!framesLeft) return false;
+    framesLeft--;
+    if (frameRepeat && t == &irprotoTiming[IRPROTO_NEC - 1]) {
+        t = &irprotoNecRepeat;          // NEC repeats are a short leader only
+        bits = 0;
+    }
+    frameRepeat = 1;
+
+    emMark = 1;
+    emTicks = 0;
+    emTotal = 0;
+    if (t->hdr_mark) {
+        irprotoEmit(true, t->hdr_mark);
+        irprotoEmit(false, t->hdr_space);
+    }
+    msb = bits ? 1UL << (bits - 1) : 0;
+    for (i = 0; i < bits; i++) {
+        if (t->flags & IRPROTO_MSB_FIRST) {
+            one = (code & msb) != 0;
+            code <<= 1;
+        } else {
+            one = code & 1;
+            code >>= 1;
+        }
+        if (one) {
+            a = t->one_a;
+            b = t->one_b;
+            spaceFirst = t->flags & IRPROTO_ONE_SPACE_FIRST;
+        } else {
+            a = t->zero_a;
+            b = t->zero_b;
+            spaceFirst = t->flags & IRPROTO_ZERO_SPACE_FIRST;
+        }
+        if ((t->flags & IRPROTO_RC6_TRAILER) && i == 4) {
+            a <<= 1;
+            b <<= 1;
+        }
+        irprotoEmit(!spaceFirst, a);
+        irprotoEmit(spaceFirst, b);
+    }
+    if (t->trail_mark) irprotoEmit(true, t->trail_mark);
+
+    // Close the frame with a space up to the repetition period, a gap longer
+    // than one Timer0 period goes to the ring as an extended edge
+    if (emMark) {
+        irsTxQueue(emTicks);
+        emTicks = 0;
+    }
+    gap = (uint32_t)t->period * IRPROTO_US(100);
+    gap = (gap > emTotal ? gap - emTotal : 0) + emTicks;
+    irsTxQueueGap(gap);
+    return true;
+}
+
+// ===================================================================================
+// Decoder
+// ===================================================================================
+// All the decoders see every edge and run side by side, each one drops out by
+// itself as soon as an edge does not fit its protocol. The times are Timer2
+// capture ticks, which run at the same clock as Timer0.
+
+#define DEC_IDLE    0                   // waiting for the leader
+#define DEC_LEADER  1                   // leader mark seen
+#define DEC_DATA    2                   // receiving the bits
+#define DEC_REPEAT  3                   // NEC repeat leader seen
+
+#define DEC_T_RC5   IRPROTO_US(889)     // RC5 half bit
+#define DEC_T_RC6   IRPROTO_US(444)     // RC6 half bit
+
+/** @brief State of a bi-phase (RC5/RC6) decoder */
+typedef struct {
+    uint8_t state;
+    uint8_t halves;                     // half bits received
+    uint8_t bits;                       // bits received
+    uint32_t code;
+} IRPROTO_BIPHASE;
+
+__xdata uint8_t irprotoRecord[IRPROTO_RECORD_LEN];
+
+static __xdata uint8_t necState, necBits; // NEC and Samsung
+static __xdata uint32_t necCode;
+static __bit necSamsung;
+static __xdata uint8_t sonyState, sonyBits; // Sony
+static __xdata uint32_t sonyCode;
+static __xdata IRPROTO_BIPHASE rc5, rc6; // RC5 and RC6
+static __bit bpFirst5, bpFirst6;        // first half of the current bit is a mark
+static __xdata uint8_t lastProto;       // the last decoded code, for the repeat flag
+static __xdata uint8_t lastToggle;
+static __idata uint32_t decClock;       // ticks of the edges and gaps seen, wraps
+static __idata uint32_t lastClock;      // decClock at the last decoded code
+static __bit decUntimed;                // the RX capture was stopped since then
+
+/** @brief Check an edge length against the nominal value, with a tolerance of
+ *  about 30%, IR receivers stretch the marks and shorten the spaces. */
+static bool decNear(uint16_t ticks, uint16_t ref){
+    uint16_t tol = (ref >> 2) + (ref >> 4);
+    return ticks >= ref - tol && ticks <= ref + tol;
+}
+
+/** @brief Fill irprotoRecord with a decoded frame. The same code again is a
+ * repeat for RC5/RC6 while the toggle bit stays, a new key press flips it. The
+ * other protocols have no toggle bit, the same code is a repeat only within
+ * one frame period (and 1/8) of the last one, both are timed at the same
+ * edge of the frame.
+ *
+ * @param[in] toggle - RC5/RC6 toggle bit, 0 for the other protocols
+ * @param[in] repeat - the frame is a repeat code (NEC)
+ * @return true
+ */
+static bool decRecord(uint8_t proto, uint16_t addr, uint8_t cmd, uint8_t toggle, bool repeat){
+    if (lastProto == proto && irprotoRecord[2] == (uint8_t)(addr >> 8)
+        && irprotoRecord[3] == (uint8_t)addr && irprotoRecord[4] == cmd
+        && lastToggle == toggle
+        && (proto == IRPROTO_RC5 || proto == IRPROTO_RC6 || (!decUntimed
+            && decClock - lastClock <= (uint32_t)irprotoTiming[proto - 1].period
+                                        * (IRPROTO_US(100) + IRPROTO_US(100) / 8)))) {
+        repeat = true;
+    }
+    irprotoRecord[0] = 'D';
+    irprotoRecord[1] = proto;
+    irprotoRecord[2] = addr >> 8;
+    irprotoRecord[3] = addr;
+    irprotoRecord[4] = cmd;
+    irprotoRecord[5] = repeat ? IRPROTO_FLAG_REPEAT : 0;
+    lastProto = proto;
+    lastToggle = toggle;
+    lastClock = decClock;
+    decUntimed = 0;
+    return true;
+}
+
+/** @brief NEC and Samsung: pulse distance coding, 32 bits LSB first */
+static bool decNec(bool mark, uint16_t ticks){
+    uint8_t a0, a1, c0, c1;
+    uint16_t addr;
+
+    switch (necState) {
+        case DEC_LEADER:
+            if (!mark && decNear(ticks, IRPROTO_US(4500))) {
+                necState = DEC_DATA;
+                necBits = 0;
+                return false;
+            }
+            if (!mark && !necSamsung && decNear(ticks, IRPROTO_US(2250))) {
+                necState = DEC_REPEAT;
+                return false;
+            }
+            break;
+        case DEC_DATA:
+            if (mark) {
+                if (!decNear(ticks, IRPROTO_US(560))) break;
+                if (necBits < 32) return false;
+                necState = DEC_IDLE;
+                a0 = necCode;
+                a1 = necCode >> 8;
+                c0 = necCode >> 16;
+                c1 = necCode >> 24;
+                if (c1 != (uint8_t)~c0) return false;
+                if (necSamsung) addr = a1 == a0 ? a0 : ((uint16_t)a1 << 8) | a0;
+                else addr = a1 == (uint8_t)~a0 ? a0 : ((uint16_t)a1 << 8) | a0;
+                return decRecord(necSamsung ? IRPROTO_SAMSUNG : IRPROTO_NEC, addr, c0, 0, false);
+            }
+            necCode >>= 1;
+            if (decNear(ticks, IRPROTO_US(1690))) necCode |= 0x80000000;
+            else if (!decNear(ticks, IRPROTO_US(560))) break;
+            if (++necBits <= 32) return false;
+            break;
+        case DEC_REPEAT:
+            necState = DEC_IDLE;
+            if (mark && decNear(ticks, IRPROTO_US(560)) && lastProto == IRPROTO_NEC)
+                return decRecord(IRPROTO_NEC, ((uint16_t)irprotoRecord[2] << 8) | irprotoRecord[3],
+                                 irprotoRecord[4], 0, true);
+            return false;
+    }
+    // Idle, or the edge did not fit: look for a new leader
+    necState = DEC_IDLE;
+    if (mark && decNear(ticks, IRPROTO_US(9000))) necSamsung = 0;
+    else if (mark && decNear(ticks, IRPROTO_US(4500))) necSamsung = 1;
+    else return false;
+    necState = DEC_LEADER;
+    return false;
+}
+
+/** @brief End of a Sony frame, the last space runs into the silence */
+static bool decSonyEnd(void){
+    bool done = sonyState == DEC_LEADER &&
+                (sonyBits == 12 || sonyBits == 15 || sonyBits == 20);
+    sonyState = DEC_IDLE;
+    if (!done) return false;
+    return decRecord(IRPROTO_SONY, sonyCode >> 7, sonyCode & 0x7f, 0, false);
+}
+
+/** @brief Sony: pulse width coding, 12/15/20 bits LSB first */
+static bool decSony(bool mark, uint16_t ticks){
+    bool one;
+
+    if (sonyState == DEC_LEADER) {          // space after the leader or a bit
+        if (mark) sonyState = DEC_IDLE;
+        else if (decNear(ticks, IRPROTO_US(600))) sonyState = DEC_DATA;
+        else return decSonyEnd();
+    } else if (sonyState == DEC_DATA) {     // bit mark
+        sonyState = DEC_IDLE;
+        if (mark && sonyBits < 20) {
+            one = decNear(ticks, IRPROTO_US(1200));
+            if (one || decNear(ticks, IRPROTO_US(600))) {
+                if (one) sonyCode |= 1UL << sonyBits;
+                sonyBits++;
+                sonyState = DEC_LEADER;
+                return false;
+            }
+        }
+    }
+    if (sonyState == DEC_IDLE && mark && decNear(ticks, IRPROTO_US(2400))) {
+        sonyState = DEC_LEADER;
+        sonyBits = 0;
+        sonyCode = 0;
+    }
+    return false;
+}
+
+/** @brief Round an edge length to whole bi-phase half bits
+ *
+ * @return the number of half bits, 0 if shorter than half of a half bit
+ */
+static uint8_t decHalves(uint16_t ticks, uint16_t t){
+    uint8_t n = 0;
+    while (ticks > (t >> 1) && n < 8) {
+        n++;
+        if (ticks < t) break;
+        ticks -= t;
+    }
+    return n;
+}
+
+/** @brief Add half bits to a bi-phase decoder. The RC6 trailer bit (bit 4)
+ *  has half bits of double length.
+ *
+ * @param[in] n - the number of (single length) half bits
+ * @return false if they break the coding
+ */
+static bool decBiphaseAdd(__xdata IRPROTO_BIPHASE *d, bool mark, uint8_t n, bool rc6){
+    uint8_t need;
+    bool first = rc6 ? bpFirst6 : bpFirst5;
+
+    while (n) {
+        need = rc6 && d->bits == 4 ? 2 : 1;
+        if (n < need) return false;
+        n -= need;
+        if (d->halves & 1) {
+            if (mark == first) return false;
+            // RC5 "1" is space-mark, RC6 "1" is mark-space
+            d->code = (d->code << 1) | (mark != rc6);
+            d->bits++;
+        } else first = mark;
+        d->halves++;
+    }
+    if (rc6) bpFirst6 = first;
+    else bpFirst5 = first;
+    return d->bits <= (rc6 ? 21 : 14);
+}
+
+/** @brief End of a bi-phase frame, a final space half bit runs into the silence */
+static bool decBiphaseEnd(__xdata IRPROTO_BIPHASE *d, bool rc6){
+    uint32_t code;
+
+    if (d->state != DEC_DATA) {
+        d->state = DEC_IDLE;
+        return false;
+    }
+    d->state = DEC_IDLE;
+    if (d->halves & 1) decBiphaseAdd(d, false, rc6 && d->bits == 4 ? 2 : 1, rc6);
+    code = d->code;
+    if (rc6) {
+        // start bit 1, mode 0
+        if (d->bits != 21 || (code & 0x1e0000) != 0x100000) return false;
+        return decRecord(IRPROTO_RC6, (uint8_t)(code >> 8), code, (code >> 16) & 1, false);
+    }
+    if (d->bits != 14) return false;
+    return decRecord(IRPROTO_RC5, (code >> 6) & 0x1f,
+                     (code & 0x3f) | ((code & 0x1000) ? 0 : 0x40), (code >> 11) & 1, false);
+}
+
+/** @brief RC5 and RC6: bi-phase coding, MSB first */
+static bool decBiphase(__xdata IRPROTO_BIPHASE *d, bool mark, uint16_t ticks, bool rc6){
+    uint8_t n = decHalves(ticks, rc6 ? DEC_T_RC6 : DEC_T_RC5);
+
+    if (d->state == DEC_DATA) {
+        if (!mark && n > 3) return decBiphaseEnd(d, rc6);
+        if (n && decBiphaseAdd(d, mark, n, rc6)) return false;
+        d->state = DEC_IDLE;
+    } else if (d->state == DEC_LEADER) {    // RC6 leader space
+        d->state = DEC_IDLE;
+        if (!mark && n == 2) {
+            d->state = DEC_DATA;
+            return false;
+        }
+    }
+    // Look for the start of a frame
+    d->halves = 0;
+    d->bits = 0;
+    d->code = 0;
+    if (!mark) return false;
+    if (rc6) {
+        if (n == 6) d->state = DEC_LEADER;
+    } else if (n == 1 || n == 2) {
+        // The first half of the RC5 start bit is a space, it is not seen
+        d->state = DEC_DATA;
+        d->halves = 1;
+        bpFirst5 = 0;
+        if (!decBiphaseAdd(d, mark, n, false)) d->state = DEC_IDLE;
+    }
+    return false;
+}
+
+bool irprotoDecode(bool mark, uint16_t ticks){
+    bool done = decNec(mark, ticks);
+    done |= decSony(mark, ticks);
+    done |= decBiphase(&rc5, mark, ticks, false);
+    done |= decBiphase(&rc6, mark, ticks, true);
+    decClock += ticks;
+    return done;
+}
+
+bool irprotoDecodeEnd(void){
+    bool done = decSonyEnd();
+    done |= decBiphaseEnd(&rc5, false);
+    done |= decBiphaseEnd(&rc6, true);
+    necState = DEC_IDLE;
+    return done;
+}
+
+bool irprotoDecodeGap(uint8_t periods, uint16_t ticks){
+    bool done = irprotoDecodeEnd();
+
+    decClock += ((uint32_t)periods << 16) + ticks;
+    return done;
+}
+
+void irprotoDecodePause(void){
+    decUntimed = 1;
+}
+
+void irprotoDecodeReset(void){
+    necState = DEC_IDLE;
+    sonyState = DEC_IDLE;
+    rc5.state = DEC_IDLE;
+    rc6.state = DEC_IDLE;
+    lastProto = 0;
+}
@@ -0,0 +1,90 @@
+// ===================================================================================
+// IR protocol synthesizer for the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// Generates the mark/space sequence of the common consumer IR protocols on the
+// device, so the host only sends a protocol ID, an address and a command instead
+// of the raw IRtoy timing data.
+//
+// Command (IRIO_TRANSMIT_PROTO), followed by IRPROTO_PARAM_LEN bytes:
+// [protocol ID] [address high] [address low] [command] [repeat count]
+//
+// In the decoding RX mode (IRIO_RX_MODE), the captured edges are run through
+// the NEC/Samsung, RC5, RC6 and Sony decoders, and every recognized frame is
+// sent to the host as a record of IRPROTO_RECORD_LEN bytes:
+// ['D'] [protocol ID] [address high] [address low] [command] [flags]
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// ===================================================================================
+// Definitions and Macros
+// ===================================================================================
+#define IRPROTO_NEC         0x01    // NEC, 8-bit address or 16-bit extended address
+#define IRPROTO_RC5         0x02    // Philips RC5, 5-bit address, 7-bit command
+#define IRPROTO_RC6         0x03    // Philips RC6 mode 0, 8-bit address and command
+#define IRPROTO_SONY        0x04    // Sony SIRC, 12/15/20 bit, chosen by the address
+#define IRPROTO_SAMSUNG     0x05    // Samsung32, 8-bit or 16-bit address
+#define IRPROTO_LAST        IRPROTO_SAMSUNG
+
+#define IRPROTO_PARAM_LEN   5       // protocol, address (2), command, repeat count
+#define IRPROTO_MAX_EDGES   74      // ring entries needed for the longest frame, an
+                                    // extended edge of 3 entries closes it
+
+#define IRPROTO_RECORD_LEN  6       // length of a decoded frame record
+#define IRPROTO_FLAG_REPEAT 0x01    // record flag: a repeat code, or the same code within a frame period
+
+/** The last decoded frame record */
+extern __xdata uint8_t irprotoRecord[IRPROTO_RECORD_LEN];
+
+// ===================================================================================
+// Function declarations
+// ===================================================================================
+
+/** @brief Prepare the synthesizer for a new code.
+ *
+ * @param[in] param - IRPROTO_PARAM_LEN bytes, the command parameters
+ * @return the carrier frequency of the protocol in Hz, 0 for an unknown protocol
+ */
+uint16_t irprotoSetup(uint8_t *param);
+
+/** @brief Queue the next frame of the code (the first frame or a repeat)
+ *  in the transmit ring, using irsTxQueue(). The caller must make sure
+ *  that IRPROTO_MAX_EDGES entries are free in the ring.
+ *
+ * @return false when all the frames are already queued
+ */
+bool irprotoFrame(void);
+
+/** @brief Feed one captured edge to the protocol decoders.
+ *
+ * @param[in] mark - true for a mark, false for a space
+ * @param[in] ticks - the length in timer ticks
+ * @return true when a frame was decoded into irprotoRecord
+ */
+bool irprotoDecode(bool mark, uint16_t ticks);
+
+/** @brief Tell the decoders that the frame has ended (long silence).
+ *
+ * @return true when a frame was decoded into irprotoRecord
+ */
+bool irprotoDecodeEnd(void);
+
+/** @brief Tell the decoders that the frame has ended with a space longer
+ *  than a Timer2 period, its length counts for the repeat flag.
+ *
+ * @param[in] periods - the whole Timer2 periods (65536 ticks) of the space
+ * @param[in] ticks - the ticks after them
+ * @return true when a frame was decoded into irprotoRecord
+ */
+bool irprotoDecodeGap(uint8_t periods, uint16_t ticks);
+
+/** @brief Tell the decoders that the RX capture was stopped, the silence is
+ *  not timed, so the next frame is not taken as a repeat by its time */
+void irprotoDecodePause(void);
+
+/** @brief Reset the decoders, the next frame is never taken as a repeat */
+void irprotoDecodeReset(void);
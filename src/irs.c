@@ -8,6 +8,8 @@
 // File:      irs.c Sampling routines (Transmission and Reception)
 // ===================================================================================
 #include "src/irs.h"
+#include "src/irproto.h"
+#include "src/irlib.h"
 #include "common.h"
 #include "stdbool.h"
 #include "system.h"
@@ -21,108 +23,403 @@ extern volatile __xdata uint8_t CDC_writePointer;
 extern uint8_t * cdc_Out_buffer; 
 extern uint8_t * cdc_In_buffer; 
 
-uint8_t *OutPtr; // Same naming of this pointer as in the irtoy code
 
 uint16_t target_freq;
 
 static unsigned char TxBuffCtr; // Transmit buffer counter
-static unsigned char h, l, tmr0_buf[3]; // Timer0 buffer
-__xdata struct _irtoy irToy; // We store the irToy structure in the xRAM
+static __xdata uint8_t *cmdPacket; // EP2 OUT packet being parsed, in place
+static __bit cmdHeld;            // cmdPacket is not handed back to the USB yet
+
+/** Transmit ring, low and high bytes of the Timer0 reload values */
+__xdata __at (TX_RING_ADDR) uint8_t txRingL[TX_RING_SIZE];
+__xdata __at (TX_RING_ADDR + TX_RING_SIZE) uint8_t txRingH[TX_RING_SIZE];
+static volatile uint8_t txHead; // Ring write index, owned by the main loop
+static volatile uint8_t txTail; // Ring read index, owned by the Timer0 ISR
+static volatile uint8_t txEnd;  // Ring index right after the last complete frame
+static uint8_t txFrameStart;     // Ring index where the last frame starts
+static uint16_t txFrameEntries;  // Ring entries queued since txFrameStart, may pass TX_RING_SIZE
+#define txRingLevel() ((uint8_t)(txHead - txTail))
+/** Ring entries that may not be overwritten, a frame that is being repeated
+ * stays in the ring as a whole */
+#define txRingUsed() ((uint8_t)(txHead - (txLoops ? txLoopStart : txTail)))
+
+/** Frame repeat (IRIO_TX_REPEAT), the Timer0 ISR jumps back from the last
+ * entry of the frame to its first one. The last entry (a space) is replaced 
+ * by the gap, txGapPeriods whole Timer0 periods and the txGapH/L reload.*/
+static volatile uint8_t txLoops; // Repeats left, counted down by the ISR
+static uint8_t txLoopStart;      // First ring entry of the repeated frame
+static uint8_t txLoopLast;       // Last ring entry of the repeated frame
+static uint8_t txGapH, txGapL;   // Reload value of the gap remainder
+static uint8_t txGapPeriods;     // Whole Timer0 periods of the gap
+static volatile uint8_t txGapLeft; // Whole periods left of the running gap
+
+/** Receive ring, the Timer2 ticks between two captures on their way from the
+ * ISR to the main loop. rxRingP holds the whole Timer2 periods on top of the
+ * ticks, it is 0 for a mark or a space and not 0 for a gap. */
+static __xdata uint8_t rxRingL[RX_RING_SIZE];
+static __xdata uint8_t rxRingH[RX_RING_SIZE];
+static __xdata uint8_t rxRingP[RX_RING_SIZE];
+static volatile uint8_t rxHead;      // Ring write index, owned by the Timer2 ISR
+static volatile uint8_t rxTail;      // Ring read index, owned by the main loop
+static volatile uint16_t rxOverflows; // Captures dropped on a full ring
+static uint16_t rxLastCap;           // Timer2 count of the last capture, Timer2 ISR only
+#define rxRingLevel() ((uint8_t)(rxHead - rxTail))
+/** Store an edge in the ring, Timer2 ISR only. The 8-bit indexes run 
+ * freely and are masked, RX_RING_SIZE is a power of two. */
+#define rxRingPut(ticks, periods) \
+    if (rxRingLevel() < RX_RING_SIZE) { \
+        rxRingL[rxHead & (RX_RING_SIZE - 1)] = (ticks); \
+        rxRingH[rxHead & (RX_RING_SIZE - 1)] = (ticks) >> 8; \
+        rxRingP[rxHead & (RX_RING_SIZE - 1)] = (periods); \
+        rxHead++; \
+    } else if (rxOverflows != 0xFFFF) { \
+        rxOverflows++; \
+    }
+/** Stop Timer2 and start the next frame from a zero count, the silence until
+ * then is not timed */
+#define rxStop() \
+    DISABLE_TIMER2(); \
+    TH2 = 0; \
+    TL2 = 0; \
+    rxLastCap = 0; \
+    irprotoDecodePause()
+/** Enable INT0, the start of the RX capture, but not while Timer0 sends: a
+ * capture restarts Timer1, the soft PWM carrier, and INT0 takes the IN buffer
+ * over. The end of the frame in the Timer0 ISR enables it again. */
+#define rxEnable() \
+    if (!txBusy) EX0 = 1
+
+static _smio irIOstate = I_IDLE; // in/out data state machine
+static __idata unsigned int txcnt = 0; // transmit byte counter, used for diagnostic
+static uint8_t txFrames;         // frames queued, but not yet reported as completed
+static __idata uint16_t txFails; // txError of the first 16 frames in txFrames, the first one in bit 0
+static __idata uint16_t protoCarrier; // carrier of the code being synthesized
+static __idata uint8_t libSlot;  // library slot being queued
+static __xdata uint8_t * __idata txDict;     // IRIO_TRANSMIT_DICT durations, in cmdPacket
+static __xdata uint8_t * __idata txDictSyms; // IRIO_TRANSMIT_DICT packed symbols, in cmdPacket
+static __idata uint8_t txDictLen; // number of durations
+static __idata uint8_t txDictEdges; // number of symbols
+static uint8_t txCredits;        // EP2 OUT packets the host may still send
+static uint8_t txFrac;           // TX rounding remainder, in 1/TIMER_0_DEN ticks
+/** converted reload values of a packet, and of an extended edge started in the one before */
+static __xdata uint8_t txStage[MAX_PACKET_SIZE + 2 * (TX_LONG_ENTRIES - 1)];
+static uint8_t txStageLen;       // bytes in txStage
+static __bit txStaged;           // txStage waits for room in the ring
+static __bit txPacketEnd;        // the converted packet ends the frame
+static uint8_t txLong;           // samples left of the extended edge escape
+static uint16_t txLongPeriods;   // whole Timer0 periods of the extended edge
+static uint8_t rxFrac;           // RX rounding remainder, in 1/TIMER_0_NUM units
+static uint8_t rxMode;           // IRS_RX_* receive mode, set by IRIO_RX_MODE
+static __bit txTicks;            // IRS_UNITS_TICKS, the TX durations are Timer0 ticks
+static __bit rxMark;             // the next captured edge is a mark
+
+/** IRS_RX_COMPACT encoder, a mark waits for its space, so that a pair equal
+ * to the last one sent is only counted (rxRun) */
+static __idata uint16_t rxPendMark; // mark of the pair being completed
+static __idata uint16_t rxPairMark; // the last pair sent
+static __idata uint16_t rxPairSpace;
+static __idata uint8_t rxRun;    // repeats of the last pair, not sent yet
+static __bit rxPend;             // rxPendMark is valid
+static __bit rxPairValid;        // the last two values sent are rxPairMark/Space
+
+/** Transmit engine flags. These are bit variables and not members of irS,
+ * since the Timer0 ISR changes them while the main loop keeps servicing
+ * commands, and a bit is set or cleared atomically. */
+static volatile __bit txBusy;    // Timer0 is clocking out the ring
+static volatile __bit txInvert;  // Carrier state of the edge in Timer0
+static volatile __bit txError;   // The ring ran dry in the middle of a frame
+static __bit txLast;             // The end of the current frame is queued
+static __bit txOdd;              // Odd number of edges queued for the frame
+static volatile __bit rxFlush;   // Timer1 timed out in RX, flush to the host
 
 #define IRS_TRANSMIT_HI	0
 #define IRS_TRANSMIT_LO	1
 
-#ifdef SOFT_PWM
-uint16_t timer1_pwm_val;
+__data uint16_t timer1_pwm_val; // soft PWM reload, read by the Timer1 interrupt
 uint16_t *timer1_pwm_ptr = &timer1_pwm_val;
+#if defined(SOFT_PWM) && defined(HW_PWM)
+__bit carrierHw = 0; // the soft PWM is the default carrier
+#endif
+/** Timer1 makes the carrier, else it is the RX flush timeout */
+#if defined(SOFT_PWM) && defined(HW_PWM)
+#define t1Carrier() (txBusy && !carrierHw)
+#elif defined(SOFT_PWM)
+#define t1Carrier() (txBusy)
+#else
+#define t1Carrier() 0
 #endif
 
 /** @brief A Structure, holding the Irdroid USB Infrared Transceiver IRs data */
 static struct {
-    uint16_t irSignal;
-    unsigned char gap : 1;
     unsigned char t2_count;
     unsigned char TXsamples;
     unsigned char timeout;
-    unsigned char TX : 1;
-    unsigned char rxflag : 1;
-    unsigned char txflag : 1;
-    unsigned char flushflag : 1;
     unsigned char overflow : 1;
-    unsigned char TXInvert : 1;
     unsigned char handshake : 1;
+    unsigned char credit : 1;
     unsigned char sendcount : 1;
     unsigned char sendfinish : 1;
     unsigned char RXcompleted : 1;
-	unsigned char txerror : 1;
 } irS;
 
-static void fast_usb_handler(void) {
-  // USB transfer completed interrupt
-  if(UIF_TRANSFER) {
-    // Dispatch to service functions
-    uint8_t callIndex = USB_INT_ST & MASK_UIS_ENDP;
-    switch (USB_INT_ST & MASK_UIS_TOKEN) {
-      case UIS_TOKEN_IN:
-        switch (callIndex) {
-          #ifdef EP2_IN_callback
-          case 2: EP2_IN_callback(); break;
-          #endif
-          default: break;
-        }
-        break;
-      case UIS_TOKEN_OUT:
-        switch (callIndex) {
-          #ifdef EP2_OUT_callback
-          case 2: EP2_OUT_callback(); break;
-          #endif
-          default: break;
-        }
-        break;
-    }
-    UIF_TRANSFER = 0;                       // clear interrupt flag
-  }
+#ifdef ASM_TIMER_ISR
+/** @brief Timer0 Interrupt routine, the assembly version of the C callback
+ *  below. It uses no R0-R7, so it needs no register bank of its own. DPTR0 is
+ *  selected and saved for the ring read, the DPTR1 of CDC_copy() is not used. The carrier
+ *  is switched in one place (05$/06$), and a drained ring clears txBusy first.
+ *  An extended edge (15$) loads its rest and leaves the periods to txGapLeft.
+ */
+void timer0_interrupt(void) __interrupt(INT_NO_TMR0) __naked
+{
+    __asm
+    clr  _TR0                   ; stop the timer
+    clr  _TF0
+    jb   _txBusy, 01$
+    reti
+01$:
+    push psw
+    push acc
+    clr  _ET0
+    mov  a, _txGapLeft          ; a long gap, one more whole period, the
+    jz   02$                    ; ticks counted since the overflow stay
+    dec  _txGapLeft
+    setb _ET0                   ; 09$ is out of the sjmp range
+    setb _TR0
+    pop  acc
+    pop  psw
+    reti
+02$:
+    mov  a, _txLoops            ; the repeat came too late for the gap,
+    jz   03$                    ; go on after the space
+    mov  a, _txLoopLast
+    inc  a
+    cjne a, _txTail, 03$
+    mov  _txTail, _txLoopStart
+    dec  _txLoops
+03$:
+    mov  a, _txHead
+    cjne a, _txTail, 05$
+    cjne a, _txEnd, 04$         ; the ring is drained, an underrun if not
+    sjmp 11$                    ; at the end of a frame
+04$:
+    setb _txError
+11$:
+    clr  PIN_asm(LED_PIN)       ; LED off
+    clr  _IE0                   ; back to RX, INT0 enabled
+    setb _EX0
+    clr  _IE0
+    clr  _txBusy
+    sjmp 06$                    ; carrier off and out
+05$:
+    cpl  _txInvert              ; HI (0) becomes LO (1), carrier on
+    jnb  _txInvert, 06$
+#if defined(SOFT_PWM) && defined(HW_PWM)
+    jnb  _carrierHw, 12$
+#endif
+#ifdef HW_PWM
+    anl  _PWM_CTRL, #0xFD       ; PWM2 start, ~bPWM_CLR_ALL
+    anl  _PIN_FUNC, #0xF7       ; ~bPWM2_PIN_X, PWM2 on P3.4
+    orl  _PWM_CTRL, #0x08       ; bPWM2_OUT_EN
+#endif
+#if defined(SOFT_PWM) && defined(HW_PWM)
+    sjmp 07$
+12$:
+#endif
+#ifdef SOFT_PWM
+    setb _TR1                   ; soft PWM on
+    setb _ET1
+#endif
+    sjmp 07$
+06$:
+#if defined(SOFT_PWM) && defined(HW_PWM)
+    jnb  _carrierHw, 13$
+#endif
+#ifdef HW_PWM
+    anl  _PWM_CTRL, #0xF7       ; PWM2 stop, ~bPWM2_OUT_EN
+#endif
+#if defined(SOFT_PWM) && defined(HW_PWM)
+    sjmp 14$
+13$:
+#endif
+#ifdef SOFT_PWM
+    clr  _TR1                   ; soft PWM off, output ground
+    clr  _ET1
+14$:
+    clr  PIN_asm(PIN_PWM)
+#endif
+    jnb  _txBusy, 10$           ; the ring was drained
+07$:
+    mov  a, _txLoops            ; the last space of a repeated frame,
+    jz   08$                    ; send the gap instead
+    mov  a, _txTail
+    cjne a, _txLoopLast, 08$
+    mov  _TH0, _txGapH
+    mov  _TL0, _txGapL
+    mov  _txGapLeft, _txGapPeriods
+    mov  _txTail, _txLoopStart
+    dec  _txLoops
+    sjmp 09$
+08$:
+    push _XBUS_AUX              ; the next ring entry, the main loop may be
+    anl  _XBUS_AUX, #0xFA       ; in CDC_copy() with DPTR1 selected, so
+    push dpl                    ; select DPTR0 (~(bDPTR_AUTO_INC | DPS))
+    push dph                    ; before saving it
+    mov  dpl, _txTail
+    mov  dph, #((TX_RING_ADDR + TX_RING_SIZE) >> 8)
+    movx a, @dptr               ; txRingH[txTail], the high byte first
+    mov  _TH0, a
+    mov  dph, #(TX_RING_ADDR >> 8)
+    movx a, @dptr               ; txRingL[txTail]
+    mov  _TL0, a
+    orl  a, _TH0                ; 0x0000, an extended edge
+    jz   15$
+    inc  _txTail
+16$:
+    pop  dph
+    pop  dpl
+    pop  _XBUS_AUX
+09$:
+    clr  _TF0
+    setb _ET0
+    setb _TR0
+10$:
+    pop  acc
+    pop  psw
+    reti
+15$:
+    inc  dpl                    ; txRingL[txTail + 1], the whole periods
+    movx a, @dptr
+    mov  _txGapLeft, a
+    inc  dpl                    ; txRingH/L[txTail + 2], the rest
+    mov  dph, #((TX_RING_ADDR + TX_RING_SIZE) >> 8)
+    movx a, @dptr
+    mov  _TH0, a
+    mov  dph, #(TX_RING_ADDR >> 8)
+    movx a, @dptr
+    mov  _TL0, a
+    mov  a, _txTail
+    add  a, #TX_LONG_ENTRIES
+    mov  _txTail, a
+    sjmp 16$
+    __endasm;
 }
+
+/** @brief Timer1 Interrupt routine, the assembly version of the C callback
+ *  below. The half period is added to the count, so the ticks since the
+ *  overflow stay counted and the carrier frequency does not depend on the
+ *  interrupt latency (T1_RELOAD_DRIFT). EA is off from the TR1 check to the
+ *  toggle, since Timer0 could turn the carrier off in between.
+ */
+void timer1_interrupt(void) __interrupt(INT_NO_TMR1) __naked
+{
+    __asm
+#if defined(SOFT_PWM) && defined(HW_PWM)
+    jb   _carrierHw, 01$        ; the PWM module makes the carrier
+#endif
+#ifdef SOFT_PWM
+    jb   _txBusy, 02$
+#endif
+01$:
+    clr  _TR1                   ; no soft carrier, the RX flush timeout
+    setb _rxFlush
+    reti
+#ifdef SOFT_PWM
+02$:
+    push psw
+    push acc
+    mov  c, _EA                 ; EA in F0, the add below changes CY,
+    mov  _F0, c                 ; the pop of psw restores F0
+    clr  _EA
+    jnb  _TR1, 03$              ; Timer0 turned the carrier off
+    clr  _TR1
+    mov  a, _TL1                ; count += timer1_pwm_val
+    add  a, _timer1_pwm_val
+    mov  _TL1, a
+    mov  a, _TH1
+    addc a, (_timer1_pwm_val + 1)
+    mov  _TH1, a
+    setb _TR1
+    cpl  PIN_asm(PIN_PWM)
+03$:
+    mov  c, _F0
+    mov  _EA, c
+    pop  acc
+    pop  psw
+    reti
+#endif
+    __endasm;
+}
+#else
 /** @brief Timer0 Interrupt callback routine */
-void timer0_int_callback(void)   
+void timer0_int_callback(void) __using(TX_ISR_BANK)
 { 
     TR0 = 0; // Disable the timer
     TF0 = 0; // Clear Timer0 interrupt flag
       
-      if (irS.TX == 1) {//timer0 interrupt means the IR transmit period is over
+      if (txBusy) {//timer0 interrupt means the IR transmit period is over
             ET0 = 0; // Disable Timer 0 interrupt
-			//in transmit mode, but no new data is available
-            if (irS.txflag == 0) { 
+            if (txGapLeft) { // a long gap, one more whole period
+                txGapLeft--; // the ticks counted since the overflow stay
+                ET0 = 1; // Enable Timer 0 interrupt
+                TR0 = 1; // Enable the timer
+                return;
+            }
+            if (txLoops && txTail == (uint8_t)(txLoopLast + 1)) {
+                // the repeat came too late for the gap, go on after the space
+                txTail = txLoopStart;
+                txLoops--;
+            }
+			//in transmit mode, but the ring is drained
+            if (txHead == txTail) { 
 
-				if(tmr0_buf[2]==0x00) irS.txerror=1; //if not end flag, raise buffer underrun error
+				if(txHead != txEnd) txError=1; //if not end of a frame, raise buffer underrun error
                 //disable the PWM, output ground
                 PWMoff();
                 LedOff();
 
                 IE0 = 0;    // Clear INT0 Flag
-                EX0 = 1;    // Enable INT0 (RX Mode)
+                rxEnable(); // Enable INT0 (RX Mode)
                 IE0 = 0;    // Clear INT0 Flag
-                irS.TX = 0;
+                txBusy = 0;
                 return;
             }
 
-            if (irS.TXInvert == IRS_TRANSMIT_HI) {
+            if (txInvert == IRS_TRANSMIT_HI) {
                 //enable the PWM
                 PWMon();
-                irS.TXInvert = IRS_TRANSMIT_LO;
+                txInvert = IRS_TRANSMIT_LO;
             } else {
                 //disable the PWM, output ground
                 PWMoff();
-                irS.TXInvert = IRS_TRANSMIT_HI;
+                txInvert = IRS_TRANSMIT_HI;
+            }
+
+            if (txLoops && txTail == txLoopLast) {
+                // the last space of a repeated frame, send the gap instead
+                TH0 = txGapH;
+                TL0 = txGapL;
+                txGapLeft = txGapPeriods;
+                txTail = txLoopStart;
+                txLoops--;
+            } else {
+                //setup timer from the next ring entry
+                TH0 = txRingH[txTail]; //first set the high byte
+                TL0 = txRingL[txTail]; //set low byte copies high byte too
+                if (TH0 | TL0) {
+                    txTail++;
+                } else {
+                    // an extended edge, the whole periods follow the rest
+                    txGapLeft = txRingL[(uint8_t)(txTail + 1)];
+                    txTail += TX_LONG_ENTRIES - 1;
+                    TH0 = txRingH[txTail];
+                    TL0 = txRingL[txTail];
+                    txTail++;
+                }
             }
-             //setup timer
-            TH0 = tmr0_buf[1]; //first set the high byte
-            TL0 = tmr0_buf[0]; //set low byte copies high byte too
     
             TF0 = 0; // Clear the interrupt flag of timer 0
             ET0 = 1; // Enable Timer 0 interrupt
             TR0 = 1; // Enable the timer
-            irS.txflag = 0; //buffer ready for new byte
         }
 }
 
@@ -131,81 +428,85 @@ void timer0_int_callback(void)
  *  as well as a timeout to flush any pending data
  *  to the USB host , when used in IR RX mode.
 */
-void timer1_int_callback(void){
-    // Fast path: if not transmitting, shut down and flag for USB flush
-    if(!irS.TX){
+void timer1_int_callback(void) __using(T1_ISR_BANK){
+    // Fast path: if not making the carrier, shut down and flag for USB flush
+    if(!t1Carrier()){
         TR1 = 0;           // Disable Timer 1 immediately
-        irS.flushflag = 1; // signal usb-service to flush
+        rxFlush = 1;         // signal usb-service to flush
         return;            // early exit avoids extra branching
     }
 
 #ifdef SOFT_PWM
-    /* Read the PWM timer value once from external xdata; this
-       reduces the number of slow __xdata accesses and avoids
-       dereferencing the pointer twice. */
-    uint16_t pwm = *timer1_pwm_ptr;
-    PIN_toggle(PIN_PWM);          // Toggle the PWM pin
+    /* Read the PWM timer value once, directly from IRAM, instead
+       of dereferencing the generic pointer twice. */
+    uint16_t pwm = timer1_pwm_val;
+    /* Timer0 can preempt this routine and turn the carrier off (PWMoff()),
+       toggle only while Timer1 still runs, else the LED stays on. */
+    __critical {
+        if (TR1) PIN_toggle(PIN_PWM); // Toggle the PWM pin
+    }
 
     /* Update Timer1 registers with the pre–inverted half‑period. */
     TH1 = pwm >> 8;
     TL1 = pwm;
 #endif
 }
-static uint16_t calculateGap(void){
-    uint32_t timer_gap = irS.t2_count * 65535;
-    return _divuint(timer_gap, TIMER_0_CONST);
-} 
+#endif
+
+/** Timer2 overflow, counts the whole periods since the last capture. The
+ * first one may come right after it, the second one is a timeout. */
+#define rxOverflow() \
+    TF2 = 0;                /* Clear overflow flag */ \
+    irS.t2_count++;         /* Increase the counter */ \
+    if(irS.t2_count >= 2 && EX0 == 0){ /* If we have timed out, enable INT0 IRQ */ \
+      EX0 = 1; \
+    } \
+    if (irS.t2_count >= 43){/* 32ms * 43 = 1.4s */ \
+        irS.t2_count = 0; \
+        irS.RXcompleted = 1;/* Flag for main loop, send packet terminator */ \
+    }
 
 /** Timer 2 Interrupt Service Routine 
  *  Timer is used to measure the IR pulse-space
- *  signal period in IR RX mode.
+ *  signal period in IR RX mode. It runs freely, an edge is the difference of
+ *  two captures, so the interrupt latency does not add to every edge and a
+ *  long frame does not drift. rxStop() zeroes it between the frames.
 */
-void timer2_int_callback(void){
-    if (TF2) {              // Did Timer2 overflowed?
-        TF2 = 0;            // Clear overflow flag
-        if(EX0 == 0){       // If we have timed out, enable INT0 IRQ
-          EX0 = 1;
-        }
-        irS.t2_count++;         // Increase the counter
-        if (irS.t2_count >= 43){// 32ms * 50 = 1600ms
-            irS.t2_count = 0;
-            irS.RXcompleted = 1;// Flag for main loop, send packet terminator
-        }
+void timer2_int_callback(void) __using(T1_ISR_BANK){
+    uint16_t cap, ticks;
+    uint8_t periods;
+
+    // an overflow after the capture belongs to the next edge, the capture
+    // is then in the upper half of the count
+    if (TF2 && !(EXF2 && (RCAP2H & 0x80))) {
+        rxOverflow();
     }
-    if (EXF2 && irS.t2_count == 0) {             // Check if capture was triggered by T2EX edge
+    if (EXF2) {             // Check if capture was triggered by T2EX edge
         EXF2 = 0;           // Clear the external flag 
         if(EX0 == 1){
             EX0 = 0;
         }
-            irS.irSignal = 0;
-            // Read captured 16-bit value from RCAP2 registers
-            irS.irSignal = (RCAP2H << 8) | RCAP2L;
-            // signal the main loop that we have pending data
-            if(irS.irSignal!=0){
-            irS.rxflag = true;
+        cap = (RCAP2H << 8) | RCAP2L;
+        ticks = cap - rxLastCap;
+        periods = irS.t2_count;
+        if (periods && cap < rxLastCap) periods--;  // the borrow of ticks
+        rxLastCap = cap;
+        irS.t2_count = 0;
+        if (periods) {
+            // The main loop scales the gap, see scale_gap_irtoy()
+            rxRingPut(ticks, periods);
+        } else {
+            // Queue the 16-bit period for the main loop, the first edge of
+            // a frame is 0
+            if (ticks) {
+                rxRingPut(ticks, 0);
             }
-        
-        // Restart Timer 1
-        RestartTimer1();
-        // Reset timer to 0 to measure period between pulses
-        TH2 = 0;
-        TL2 = 0;
-    }else if (EXF2 && irS.t2_count != 0){
-        EXF2 = 0;           // Clear the external flag 
-        if(EX0 == 1){
-            EX0 = 0;
+            // Restart Timer 1
+            RestartTimer1();
         }
-            irS.irSignal = 0;
-            irS.irSignal = (RCAP2H << 8) | RCAP2L;
-            irS.irSignal = _divuint(irS.irSignal, TIMER_0_CONST) + calculateGap();
-             // signal the main loop that we have pending data
-            if(irS.irSignal!=0){
-            irS.gap = 1;
-            }
-        irS.t2_count = 0;
-        // Reset timer to 0 to measure period between pulses
-        TH2 = 0;
-        TL2 = 0;
+    }
+    if (TF2) {
+        rxOverflow();
     }
 }
 
@@ -215,21 +516,846 @@ void timer2_int_callback(void){
 
 /** @brief Align the irtoy time to the ch552 time unit 
  * The irtoy time unit is with resolution of 21.333us and
- * the CH55x timer0 is configured for 167ns thus to be compatible
+ * the CH55x timer0 is configured for 0.5us thus to be compatible
  * with the existing Irtoy/Irdroid Driver on the host side, we need 
- * to align that. This function should perform as fast as possible
+ * to align that. One irtoy unit is 42.667 timer ticks, so the rounding
+ * remainder is carried over to the next edge (txFrac) and a long frame
+ * does not drift. This function should perform as fast as possible
  * 
  * @param[in] timer_h - The high byte in the buffer,comming from the host
  * @param[in] timer_l - The low bytes in the buffer, comming from the host
  * @param[out] buf - The buffer in which we are storing the result
 */
 static inline void align_irtoy_ch552(uint8_t timer_h, uint8_t timer_l, uint8_t *buf){
-    uint_fast16_t time_val = ((timer_h << 8) | timer_l);
-    time_val = time_val*TIMER_0_CONST;
+    uint_fast16_t irtoy_val = ((timer_h << 8) | timer_l);
+    uint_fast16_t time_val = irtoy_val*TIMER_0_CONST;
+#if TIMER_0_DEN > 1
+    // TIMER_0_CONST is 1/TIMER_0_DEN tick too long per unit, take the whole 
+    // ticks back and carry the remainder
+    uint_fast16_t excess = irtoy_val / TIMER_0_DEN;
+    uint8_t rem = irtoy_val - excess * TIMER_0_DEN;
+    time_val -= excess;
+    if (txFrac < rem) {
+        time_val--;
+        txFrac += TIMER_0_DEN;
+    }
+    txFrac -= rem;
+#endif
     *buf++ = (time_val >> 8) & 0xff;
     *buf = time_val;
 }
 
+/** x * TIMER_0_DEN with a shift and an add, SDCC would call _mulint */
+#if TIMER_0_DEN == 3
+#define MUL_DEN(x) (((x) << 1) + (x))
+#else
+#define MUL_DEN(x) ((x) * TIMER_0_DEN)
+#endif
+
+/** @brief Scale a Timer2 capture to irtoy time units, the reverse of 
+ * align_irtoy_ch552(). Uses the exact TIMER_0_DEN/TIMER_0_NUM ratio, which
+ * needs no division, and carries the remainder over to the next edge (rxFrac).
+ * 
+ * @param[in] ticks - The captured period in timer ticks
+ * @return the period in irtoy time units
+ */
+static uint16_t scale_ch552_irtoy(uint16_t ticks){
+    uint16_t frac = MUL_DEN(ticks & (TIMER_0_NUM - 1)) + rxFrac;
+    rxFrac = frac & (TIMER_0_NUM - 1);
+    return MUL_DEN(ticks >> TIMER_0_NUM_SHIFT) + (frac >> TIMER_0_NUM_SHIFT);
+}
+
+/** @brief Scale a gap, whole Timer2 periods and a capture, to irtoy time units.
+ * A period is exactly TIMER_2_PERIOD_UNITS, so the periods are only added up.
+ * Saturates below the 0xFFFF end of data marker.
+ * 
+ * @param[in] periods - The Timer2 overflows during the gap
+ * @param[in] ticks - The captured rest of the gap in timer ticks
+ * @return the gap in irtoy time units
+ */
+static uint16_t scale_gap_irtoy(uint8_t periods, uint16_t ticks){
+    uint16_t units;
+
+    rxFrac = 0;
+    units = scale_ch552_irtoy(ticks);
+    while (periods--) {
+        if (units >= 0xFFFE - TIMER_2_PERIOD_UNITS) return 0xFFFE;
+        units += TIMER_2_PERIOD_UNITS;
+    }
+    return units;
+}
+
+/** @brief Queue one Timer0 reload value in the transmit ring. 0x0000 marks
+ * an extended edge, a full period is queued as 0x0001, one tick short. */
+static inline void txRingPut(uint8_t reload_h, uint8_t reload_l){
+    if (!(reload_h | reload_l)) reload_l = 1;
+    txRingH[txHead] = reload_h;
+    txRingL[txHead] = reload_l;
+    txHead++;
+    txFrameEntries++;
+    txOdd = !txOdd;
+}
+
+/** @brief Queue an extended edge in the transmit ring. The entries are filled
+ * before txHead moves, the Timer0 ISR reads all of them at once.
+ * 
+ * @param[in] periods - The whole Timer0 periods after the rest
+ * @param[in] reload_h - The reload value of the rest, high byte
+ * @param[in] reload_l - The reload value of the rest, low byte
+ */
+static void txRingPutLong(uint8_t periods, uint8_t reload_h, uint8_t reload_l){
+    txRingH[(uint8_t)(txHead + 1)] = 0;
+    txRingL[(uint8_t)(txHead + 1)] = periods;
+    txRingH[(uint8_t)(txHead + 2)] = reload_h;
+    txRingL[(uint8_t)(txHead + 2)] = reload_l;
+    txRingH[txHead] = 0;
+    txRingL[txHead] = 0;
+    txHead += TX_LONG_ENTRIES;
+    txFrameEntries += TX_LONG_ENTRIES;
+    txOdd = !txOdd;
+}
+
+/** The packet conversion kernel (txKernel()) is written in assembly for SDCC,
+ * it is the C loop of txConvertC() with MUL AB for the multiplications and the
+ * division by 3. It must give the same values, the bench compares the two
+ * (txKernel_mismatch). TX_ASM_KERNEL in config.h selects it, else the C loop
+ * runs, TX_KERNEL_REF keeps the C loop next to the assembly for the comparison. */
+#if defined(__SDCC) && defined(TX_ASM_KERNEL) && TIMER_0_DEN == 3 && TIMER_0_CONST == 43
+#define ASM_TX_KERNEL
+#endif
+
+#if !defined(ASM_TX_KERNEL) || defined(TX_KERNEL_REF)
+/** @brief Convert IRtoy samples to Timer0 reload values, straight into the 
+ * transmit ring, or into out. Stops at the 0xFFFF end of data marker and sets
+ * txPacketEnd, and in front of the 0x0000 extended edge escape.
+ * 
+ * @param[in] buf - The samples, in the EP2 OUT buffer
+ * @param[in] len - The number of bytes in the buffer
+ * @param[out] out - txStage (or buf, in place), or NULL for the ring
+ * @return the number of sample bytes converted
+ */
+static uint8_t txConvertC(uint8_t *buf, uint8_t len, __xdata uint8_t *out){
+    uint8_t i, h, l;
+    uint8_t reload[2];
+
+    for (i = 0; i < len; i += 2, buf += 2) {
+        h = *buf;
+        l = *(buf + 1);
+        if (!(h | l)) return i; // the extended edge escape
+        //check here for 0xff 0xff, the last sample of the frame
+        if (h == 0xff && l == 0xff) {
+            txPacketEnd = 1;
+            h = 40; // JTR3 replace 0xFFFF with 0020 (Ian's value)
+            l = 0;
+        }
+
+        align_irtoy_ch552(h, l, reload);
+
+        // This cute code calculates the two's compliment (subtract from zero)
+        // The quick way to do this in invert and add 1.
+        h = ~reload[0];
+        l = ~reload[1];
+
+        l += 1;
+        if (l == 0) // did we get rollover in LSB?
+            h += 1; // then must add the carry to MSB
+
+        if (out) {
+            if (!(h | l)) l = 1; // as txRingPut() does
+            *out++ = h;
+            *out++ = l;
+        } else {
+            txRingPut(h, l);
+        }
+        if (txPacketEnd) return i + 2;
+    }
+    return i;
+}
+#endif
+
+#ifdef ASM_TX_KERNEL
+static __xdata uint8_t * __data txKernelBuf; // the samples, converted in place
+static __data uint8_t txKernelLen;           // bytes in, bytes converted out
+
+/** @brief txConvertC() in place, in assembly, on txKernelBuf and txKernelLen.
+ * Per sample v = H:L, with txFrac held in r6:
+ *   q = v / 3 = (v * 0xAAAB) >> 17, four MUL AB, only the carries of the
+ *       lower bytes are kept
+ *   r = v % 3 = L - 3 * q (the low bytes are enough)
+ *   txFrac -= r, borrowing TIMER_0_DEN when it is short
+ *   reload = -(43 * v - q - borrow) = q + borrow - 43 * v
+ * The samples are at even addresses, so H is one dec dpl behind L. Stops in
+ * front of a 0x0000 sample, the extended edge escape.
+ */
+static void txKernel(void) __naked
+{
+    __asm
+    mov  dpl, _txKernelBuf
+    mov  dph, (_txKernelBuf + 1)
+    mov  r6, _txFrac            ; r6 <- txFrac
+    mov  a, _txKernelLen        ; r7 <- samples, (len + 1) / 2
+    inc  a
+    clr  c
+    rrc  a
+    mov  r7, a
+    jnz  01$
+    ret                         ; no samples, txKernelLen is 0
+11$:
+    setb _txPacketEnd           ; the end of data marker, the last sample,
+    mov  r2, #40                ; JTR3 replace 0xFFFF with 0x2800
+    mov  r3, #0x00
+    mov  r7, #1
+    sjmp 02$                    ; out of the loop, djnz reaches only 128 bytes
+01$:
+    movx a, @dptr               ; r2 <- H
+    mov  r2, a
+    inc  dptr
+    movx a, @dptr               ; r3 <- L
+    mov  r3, a
+    orl  a, r2                  ; the extended edge escape
+    jz   10$
+    mov  a, r3
+    cjne r2, #0xFF, 02$
+    cjne a, #0xFF, 02$
+    sjmp 11$                    ; the end of data marker
+02$:
+    mov  a, r3                  ; L * 0xAB, byte 1
+    mov  b, #0xAB
+    mul  ab
+    mov  r4, b
+    mov  a, r3                  ; L * 0xAA, bytes 1 and 2
+    mov  b, #0xAA
+    mul  ab
+    add  a, r4
+    mov  r4, a
+    mov  a, b
+    addc a, #0x00
+    mov  r5, a
+    mov  a, r2                  ; H * 0xAB, bytes 1 and 2, the carry to byte 3
+    mov  b, #0xAB
+    mul  ab
+    add  a, r4
+    mov  a, r5
+    addc a, b
+    mov  r5, a
+    clr  a
+    rlc  a
+    mov  r0, a
+    mov  a, r2                  ; H * 0xAA, bytes 2 and 3
+    mov  b, #0xAA
+    mul  ab
+    add  a, r5
+    mov  r5, a
+    mov  a, b
+    addc a, r0
+    clr  c                      ; r1:r0 <- q, bytes 3:2 >> 1
+    rrc  a
+    mov  r1, a
+    mov  a, r5
+    rrc  a
+    mov  r0, a
+    mov  b, #3                  ; b <- r = L - 3 * q
+    mul  ab
+    mov  b, a
+    mov  a, r3
+    clr  c
+    subb a, b
+    mov  b, a
+    mov  a, r6                  ; txFrac -= r, the borrow is in CY, also
+    clr  c                      ; after the add, as txFrac - r is 0xFE or
+    subb a, b                   ; 0xFF then
+    jnc  03$
+    add  a, #3
+03$:
+    mov  r6, a
+    mov  a, r0                  ; q += borrow
+    addc a, #0x00
+    mov  r0, a
+    mov  a, r1
+    addc a, #0x00
+    mov  r1, a
+    mov  a, r3                  ; r2:r3 <- 43 * v, the low 16 bits
+    mov  b, #43
+    mul  ab
+    mov  r3, a
+    mov  r4, b
+    mov  a, r2
+    mov  b, #43
+    mul  ab
+    add  a, r4
+    mov  r2, a
+    clr  c                      ; reload = q - 43 * v
+    mov  a, r0
+    subb a, r3
+    mov  r3, a
+    mov  a, r1
+    subb a, r2
+    xch  a, r3
+    movx @dptr, a               ; the low byte to L
+    dec  dpl
+    mov  a, r3
+    movx @dptr, a               ; the high byte to H
+    inc  dptr
+    inc  dptr
+    djnz r7, 01$
+    sjmp 09$
+10$:
+    dec  dpl                    ; back to H, not converted
+09$:
+    mov  _txFrac, r6
+    mov  a, dpl                 ; the bytes converted, at most 64
+    clr  c
+    subb a, _txKernelBuf
+    mov  _txKernelLen, a
+    ret
+    __endasm;
+}
+#endif
+
+#ifdef ASM_TX_KERNEL
+/** @brief txConvertC() with the assembly kernel, converts in place and 
+ * copies the reload values */
+static uint8_t txConvertRun(uint8_t *buf, uint8_t len, __xdata uint8_t *out){
+    uint8_t i, h, l;
+
+    txKernelBuf = (__xdata uint8_t *)buf;
+    txKernelLen = len;
+    txKernel();
+    len = txKernelLen;
+    for (i = 0; i < len; i += 2, buf += 2) {
+        h = *buf;
+        l = *(buf + 1);
+        if (out) {
+            if (!(h | l)) l = 1; // as txRingPut() does
+            *out++ = h;
+            *out++ = l;
+        } else {
+            txRingPut(h, l);
+        }
+    }
+    return len;
+}
+#else
+#define txConvertRun txConvertC
+#endif
+
+/** @brief txConvertC() for IRS_UNITS_TICKS, the samples are Timer0 ticks 
+ * already, only the two's complement is taken
+ * 
+ * @param[in] buf - The samples, in the EP2 OUT buffer
+ * @param[in] len - The number of bytes in the buffer
+ * @param[out] out - txStage, or NULL for the ring
+ * @return the number of sample bytes converted
+ */
+static uint8_t txConvertTicks(uint8_t *buf, uint8_t len, __xdata uint8_t *out){
+    uint8_t i;
+    uint16_t ticks;
+
+    for (i = 0; i < len; i += 2, buf += 2) {
+        ticks = (*buf << 8) | *(buf + 1);
+        if (ticks == 0) return i; // the extended edge escape
+        if (ticks == 0xFFFF) {
+            txPacketEnd = 1;
+            ticks = 0x2800; // as in irtoy units
+        }
+        ticks = -ticks; // Timer0 counts up to the overflow
+        if (out) {
+            *out++ = ticks >> 8;
+            *out++ = ticks;
+        } else {
+            txRingPut(ticks >> 8, ticks);
+        }
+        if (txPacketEnd) return i + 2;
+    }
+    return i;
+}
+
+/** @brief Take one sample of an extended edge escape, [periods] or [ticks],
+ * the edge is queued after the last one.
+ * 
+ * @param[in] buf - The sample
+ * @param[out] out - txStage, or NULL for the ring
+ * @return out, after the queued entries
+ */
+static __xdata uint8_t *txLongSample(uint8_t *buf, __xdata uint8_t *out){
+    uint16_t ticks = (*buf << 8) | *(buf + 1);
+
+    if (--txLong) {
+        txLongPeriods = ticks;
+        return out;
+    }
+    // periods * 65536 + ticks = whole periods + a rest of 1..65536 ticks
+    if (ticks == 0) {
+        if (txLongPeriods) txLongPeriods--;
+        else ticks = 1;
+    }
+    if (txLongPeriods > TX_LONG_PERIODS_MAX) {
+        txLongPeriods = TX_LONG_PERIODS_MAX;
+        ticks = 0;
+    }
+    ticks = -ticks; // Timer0 counts up to the overflow, 0 is 65536 ticks
+    if (out) {
+        *out++ = 0;
+        *out++ = 0;
+        *out++ = 0;
+        *out++ = txLongPeriods;
+        *out++ = ticks >> 8;
+        *out++ = ticks;
+    } else {
+        txRingPutLong(txLongPeriods, ticks >> 8, ticks);
+    }
+    return out;
+}
+
+/** @brief Convert the IRtoy samples of one EP2 OUT packet to Timer0 reload
+ * values, straight into the transmit ring, or into txStage when the ring has
+ * no room for them yet. Either way it is done as soon as the packet arrives,
+ * so the EP2 OUT buffer is given back to the host right away, and the Timer0 
+ * ISR only copies the reload values. Stops at the 0xFFFF end of data marker
+ * and sets txPacketEnd. An extended edge escape may go on in the next packet.
+ * 
+ * @param[in] buf - The EP2 OUT buffer holding the samples (converted in place)
+ * @param[in] len - The number of bytes in the buffer
+ * @param[out] out - txStage (sets txStageLen), or NULL for the ring
+ * @return the number of sample bytes converted
+ */
+static uint8_t txConvert(uint8_t *buf, uint8_t len, __xdata uint8_t *out){
+    uint8_t i = 0, n;
+
+    while (i < len && !txPacketEnd) {
+        if (txLong) {
+            out = txLongSample(buf + i, out);
+            i += 2;
+        } else {
+            if (txTicks) {
+                n = txConvertTicks(buf + i, len - i, out);
+            } else {
+                n = txConvertRun(buf + i, len - i, out);
+            }
+            if (out) out += n;
+            i += n;
+            if (i < len && !txPacketEnd) {
+                txLong = 2; // stopped in front of the escape
+                i += 2;
+            }
+        }
+    }
+    if (out) txStageLen = out - txStage;
+    return i;
+}
+
+/** @brief Close the frame after its last packet is in the ring, sets txLast */
+static void txFrameEnd(void){
+    txPacketEnd = 0;
+    txLast = 1;
+    // A frame queued right behind this one must start with a mark,
+    // pad with a single tick if this frame has an odd number of edges
+    if (txOdd) txRingPut(0xff, 0xff);
+    txEnd = txHead;
+}
+
+/** @brief Queue the reload values waiting in txStage in the transmit ring */
+static void txStageFlush(void){
+    uint8_t i;
+    __xdata uint8_t *buf = txStage;
+
+    for (i = 0; i < txStageLen; i += 2, buf += 2) {
+        if (*buf | *(buf + 1)) {
+            txRingPut(*buf, *(buf + 1));
+        } else {
+            txRingPutLong(*(buf + 3), *(buf + 4), *(buf + 5));
+            i += 2 * (TX_LONG_ENTRIES - 1);
+            buf += 2 * (TX_LONG_ENTRIES - 1);
+        }
+    }
+    txStaged = 0;
+    if (txPacketEnd) txFrameEnd();
+}
+
+/** @brief Load the first queued edge into Timer0 and start the TX engine */
+static void txStart(void){
+    EX0 = 0; // no RX while sending, see rxEnable()
+    rxStop();
+    EXF2 = 0;
+    txBusy = 1;
+    TH0 = txRingH[txTail]; //first set the high byte
+    TL0 = txRingL[txTail]; //set low byte copies high byte too
+    if (TH0 | TL0) {
+        txTail++;
+    } else {
+        // an extended edge, the whole periods follow the rest
+        txGapLeft = txRingL[(uint8_t)(txTail + 1)];
+        txTail += TX_LONG_ENTRIES - 1;
+        TH0 = txRingH[txTail];
+        TL0 = txRingL[txTail];
+        txTail++;
+    }
+
+    TF0 = 0; // Clear the interrupt flag of timer 0
+    ET0 = 1; // Enable Timer 0 interrupt
+    TR0 = 1; //enable the timer
+    //enable the PWM
+    PWMon();
+    txInvert = IRS_TRANSMIT_LO;
+    LedOn();
+}
+
+/** @brief Send the number of transmitted bytes to the host */
+static void txSendCount(void){
+    WaitInReady();
+    cdc_In_buffer = inWhich();
+    cdc_In_buffer[0] = 't';
+    cdc_In_buffer[1] = (txcnt >> 8)&0xff;
+    cdc_In_buffer[2] = (txcnt & 0xff);
+    CDC_writePointer += 3;
+    CDC_flush(); // flush the buffer 
+}
+
+/** @brief Top up the credits of the host (IRIO_TX_CREDIT). One byte, the
+ * number of EP2 OUT packets it may send on top of the ones it still has 
+ * credit for. The ring room and the endpoint buffer are counted, and the top
+ * ups are batched by TX_CREDIT_MIN. Skipped while the IN endpoint is busy, 
+ * so the main loop never waits for the host.
+ */
+static void txCreditService(void){
+    uint8_t room = (uint8_t)(TX_RING_SIZE - 1 - txRingUsed()) / TX_PACKET_EDGES + 1;
+
+    if (room <= txCredits) return;
+    room -= txCredits;
+    if (room < TX_CREDIT_MIN && txCredits) return;
+    if (CDC_writeBusyFlag || CDC_writePointer) return;
+    cdc_In_buffer = inWhich();
+    cdc_In_buffer[0] = room;
+    CDC_writePointer += sizeof(uint8_t); // Increment the write counter
+    CDC_flush(); // flush the buffer 
+    cdc_In_buffer = inWhich();
+    txCredits += room;
+}
+
+/** @brief The whole frame is queued, return to the command parser. An
+ * underrun can only hit the frame being queued, txError is its own error, 
+ * the ring ends at txEnd now, so the Timer0 ISR does not raise it again.
+ */
+static void txFrameQueued(void){
+    if (txError) {
+        txError = 0;
+        if (txFrames < 16) txFails |= (uint16_t)1 << txFrames;
+    }
+    txFrames++;
+    irIOstate = I_IDLE;
+    if (irS.sendcount) { //return the total number of bytes transmitted if required
+        txSendCount();
+    }
+}
+
+/** @brief Switch the carrier for the next frame, this waits for the frames
+ * queued before to go out at their own carrier.
+ *
+ * @param[in] carrier - The carrier frequency in Hz
+ * @return false while the TX engine still runs at the old carrier
+ */
+static bool txCarrier(uint16_t carrier){
+    if (carrier != target_freq) {
+        if (txBusy) return false;
+        target_freq = carrier;
+        PwmConfigure(target_freq, timer1_pwm_ptr);
+    }
+    return true;
+}
+
+/** @brief Step the transmit state machine (I_TX_STATE). Converts the next EP2
+ * OUT packet as soon as it arrives, into the ring or into txStage (see 
+ * txConvert()), gives the buffer back to the host and starts the Timer0 
+ * engine. Never waits, so the main loop keeps running during TX. When the end
+ * of the frame is queued, the command parser takes over again while the ring
+ * drains, so the next frame can be queued right behind it. Nothing is taken
+ * after a staged end of a frame, the next packet is a command.
+ */
+static void txService(void){
+    uint8_t len;
+
+    if (txStaged && txRingUsed() <= TX_RING_HIGH_WM) {
+        txStageFlush();
+    }
+    if (!txStaged && !txLast && CDC_readByteCount) {
+        len = CDC_readByteCount;
+        if (txRingUsed() <= TX_RING_HIGH_WM) {
+            len = txConvert(OutWhich(), len, NULL);
+            if (txPacketEnd) txFrameEnd();
+        } else {
+            len = txConvert(OutWhich(), len, txStage);
+            txStaged = 1;
+        }
+        txcnt += len; //total bytes transmitted
+        CDC_readByteCount = 0;
+        // Ask for more bytes, the next packet goes to the other half of
+        // the double buffer
+        UEP2_CTRL = (UEP2_CTRL & ~MASK_UEP_R_RES)| UEP_R_RES_ACK;  
+        // Ask the host to send us 62 bytes
+        if (irS.handshake) {
+            cdc_In_buffer = inWhich();
+            WaitInReady();
+            cdc_In_buffer[0] = MAX_PACKET_SIZE;
+            CDC_writePointer += sizeof(uint8_t); // Increment the write counter
+            CDC_flush(); // flush the buffer 
+        }                  
+        if (txCredits) txCredits--;
+    }
+    // Start the TX engine once enough edges are queued ahead of it
+    if (!txBusy && txRingLevel() && (txRingLevel() >= TX_RING_LOW_WM || txLast)) {
+        txStart();
+    }
+    if (txLast) {
+        txFrameQueued();
+    } else if (irS.credit) {
+        txCreditService();
+    }
+}
+
+void irsTxQueue(uint16_t ticks){
+    ticks = -ticks; // Timer0 counts up to the overflow
+    txRingPut(ticks >> 8, ticks);
+    txcnt += 2;
+}
+
+void irsTxQueueGap(uint32_t ticks){
+    uint16_t reload;
+
+    if (ticks == 0) ticks = 1;
+    reload = -(uint16_t)ticks; // 0 is 65536 ticks
+    if (ticks <= 0x10000) {
+        irsTxQueue(ticks);
+        return;
+    }
+    // ticks = whole periods * 65536 + a rest of 1..65536 ticks
+    txRingPutLong((ticks - 1) >> 16, reload >> 8, reload);
+    txcnt += 2;
+}
+
+/** @brief Step the protocol synthesizer (I_PROTO_STATE). Queues the next frame
+ * of the code whenever the ring has room for a whole frame. The carrier is 
+ * only changed while the TX engine is idle.
+ * 
+ * @param[in] carrier - The carrier frequency of the protocol in Hz
+ */
+static void protoService(uint16_t carrier){
+    if (!txCarrier(carrier)) return;
+    if ((uint8_t)(TX_RING_SIZE - 1 - txRingUsed()) < IRPROTO_MAX_EDGES) return;
+    if (irprotoFrame()) {
+        txEnd = txHead;
+        if (!txBusy) txStart();
+    } else {
+        txFrameQueued();
+    }
+}
+
+/** @brief Step the library replay (I_LIB_STATE). Copies the reload values of
+ * the slot to the ring, once the ring has room for the whole frame. An 
+ * extended edge is copied as it is, its three entries are one edge. An empty
+ * slot is reported as a failed frame.
+ */
+static void libService(void){
+    __code IRLIB_SLOT *s = irlibGet(libSlot);
+    uint8_t i;
+
+    if (s == NULL) {
+        txError = 1;
+    } else {
+        if (!txCarrier(s->carrier)) return;
+        if ((uint8_t)(TX_RING_SIZE - 1 - txRingUsed()) < s->edges) return;
+        for (i = 0; i < s->edges; i++) {
+            if (s->reload[i] == 0 && s->edges - i >= TX_LONG_ENTRIES) {
+                txRingPutLong(s->reload[i + 1], s->reload[i + 2] >> 8, s->reload[i + 2]);
+                i += TX_LONG_ENTRIES - 1;
+            } else {
+                txRingPut(s->reload[i] >> 8, s->reload[i]);
+            }
+        }
+        txcnt += (uint16_t)s->edges << 1;
+        txEnd = txHead;
+        if (!txBusy) txStart();
+    }
+    txFrameQueued();
+}
+
+/** @brief Check an IRIO_TRANSMIT_DICT command and point the expansion
+ * (I_DICT_STATE) at it. The command stays in the EP2 OUT buffer until it 
+ * is queued, also when its packet is handed back (cmdRelease()), the next 
+ * packet goes to the other half of the double buffer and waits there.
+ *
+ * @param[in] buf - The command bytes after IRIO_TRANSMIT_DICT
+ * @param[in] len - The number of bytes left in the packet
+ * @return the number of bytes of the command, 0 if it is not complete
+ */
+static uint8_t dictSetup(__xdata uint8_t *buf, uint8_t len){
+    uint8_t head, syms;
+
+    txDictLen = buf[0];
+    if (txDictLen < 2 || txDictLen > TX_DICT_MAX) return 0;
+    head = 2 + (txDictLen << 1); // length, the durations and the edges
+    if (len < head) return 0;
+    txDictEdges = buf[head - 1];
+    if (txDictLen <= 4) {
+        syms = (txDictEdges + 3) >> 2;
+    } else {
+        syms = (txDictEdges + 1) >> 1;
+    }
+    if (txDictEdges == 0 || len - head < syms) return 0;
+    txDict = buf + 1;
+    txDictSyms = buf + head;
+    return head + syms;
+}
+
+/** @brief Step the dictionary frame expansion (I_DICT_STATE). Once the ring
+ * has room for the whole frame, every symbol is looked up and converted to
+ * a Timer0 reload value, with the same rounding as the 2 byte samples. A
+ * symbol past the dictionary is sent as the first duration and the frame is 
+ * reported as failed.
+ */
+static void dictService(void){
+    uint8_t i, sym, bits = 0;
+    __xdata uint8_t *d;
+    uint8_t buf[2];
+    __bit wide = txDictLen > 4;
+
+    if ((uint8_t)(TX_RING_SIZE - 1 - txRingUsed()) <= txDictEdges) return;
+    for (i = 0; i < txDictEdges; i++) {
+        if (wide) {
+            if (!(i & 1)) bits = *txDictSyms++;
+            sym = bits >> 4;
+            bits <<= 4;
+        } else {
+            if (!(i & 3)) bits = *txDictSyms++;
+            sym = bits >> 6;
+            bits <<= 2;
+        }
+        if (sym >= txDictLen) {
+            sym = 0;
+            txError = 1;
+        }
+        d = txDict + (sym << 1);
+        if (txTicks) {
+            buf[0] = d[0];
+            buf[1] = d[1];
+        } else {
+            align_irtoy_ch552(d[0], d[1], buf);
+        }
+        // Timer0 counts up to the overflow
+        txRingPut(~buf[0] + (buf[1] == 0), -buf[1]);
+        // the engine starts ahead of a long frame, as in txService()
+        if (i == TX_RING_LOW_WM && !txBusy) txStart();
+    }
+    // a frame queued right behind must start with a mark
+    if (txOdd) txRingPut(0xff, 0xff);
+    txcnt += (uint16_t)txDictEdges << 1;
+    txEnd = txHead;
+    if (!txBusy) txStart();
+    txFrameQueued();
+}
+
+/** @brief Store the last queued frame in a library slot, the frame is still
+ * in the ring once it has been sent. A frame that took more entries than
+ * the ring holds has lost its start and is not stored.
+ *
+ * @param[in] slot - The slot number
+ * @return true if the frame is stored
+ */
+static bool libStore(uint8_t slot){
+    uint8_t i, edges = txEnd - txFrameStart;
+    bool ok;
+
+    if (txBusy || edges == 0 || edges != txFrameEntries) return false;
+    if (edges > IRLIB_SLOT_EDGES) return false;
+    if (!irlibOpen(slot)) return false;
+    ok = irlibWrite(edges) && irlibWrite(target_freq);
+    for (i = txFrameStart; ok && i != txEnd; i++) {
+        ok = irlibWrite(((uint16_t)txRingH[i] << 8) | txRingL[i]);
+    }
+    irlibClose();
+    return ok;
+}
+
+/** @brief Repeat the last queued frame straight from the ring. If the frame
+ * is still being sent, the first repeat follows it after the gap, else the
+ * frame is sent again right away and is reported as a frame of its own. A
+ * frame that ends with an extended edge keeps its last space, the gap is not
+ * used then. A frame longer than the ring is not repeated, its start is
+ * overwritten.
+ *
+ * @param[in] count - The number of repeats
+ * @param[in] gap - The space after the last mark of the frame, in irtoy units
+ *                  or in ticks (IRIO_UNITS)
+ */
+static void txRepeat(uint8_t count, uint16_t gap){
+    uint32_t ticks = txTicks ? gap : (uint32_t)gap * TIMER_0_NUM / TIMER_0_DEN;
+    uint16_t reload;
+
+    if (count == 0 || txEnd == txFrameStart || txFrameEntries >= TX_RING_SIZE) return;
+    if (ticks == 0) ticks = 1;
+    // ticks = whole periods * 65536 + a remainder of 1..65536 ticks
+    txGapPeriods = (ticks - 1) >> 16;
+    reload = -(uint16_t)ticks;
+    ET0 = 0; // the ISR must not see a half set up loop
+    txGapH = reload >> 8;
+    txGapL = reload;
+    txLoopStart = txFrameStart;
+    txLoopLast = txEnd - 1;
+    if (txBusy) {
+        txLoops = count;
+        ET0 = 1; // Enable Timer 0 interrupt
+    } else {
+        txLoops = count - 1;
+        txTail = txFrameStart;
+        txFrames++; // the first one is reported already
+        txStart();
+    }
+}
+
+/** @brief Prepare the ring for a new frame. The ring is emptied if the engine 
+ * is idle, else the frame is queued right behind the one that still drains.
+ */
+static void txNewFrame(void){
+    txcnt = 0; //reset transmit byte counter, used for diagnostic
+    if (!txBusy && txRingLevel() == 0) {
+        ET0 = 0; // Disable Timer 0 interrupt
+        TR0 = 0; //disable the timer
+        txHead = 0; // the engine is idle, start with an empty ring
+        txTail = 0;
+        txEnd = 0;
+        LedOff();
+    }
+    txOdd = 0;
+    txStaged = 0;
+    txPacketEnd = 0;
+    txLong = 0;
+    txFrameStart = txHead;
+    txFrameEntries = 0;
+}
+
+/** @brief Report the completed frames to the host, once the ring is drained.
+ * txError stays for the frame being queued, see txFrameQueued().
+ */
+static void txComplete(void){
+    LedOff();
+    if (irS.sendfinish) { // Really redundant giving we can send a count above.
+        WaitInReady();
+        cdc_In_buffer = inWhich();
+        while (txFrames) {
+            *cdc_In_buffer++ = (txFails & 1) ? 'F' : 'C';
+            CDC_writePointer += 1;
+            txFails >>= 1;
+            txFrames--;
+        }
+        CDC_flush(); // flush the buffer 
+        cdc_In_buffer = inWhich();
+    }
+    txFrames = 0;
+    txFails = 0;
+#ifdef SOFT_PWM
+    rxFlush = 1; // the soft carrier took Timer1 over, with its RX flush timeout
+#endif
+}
+
 /** @brief Calculate the IR Tx Carrier frequency in HZ, coming from the host.
  * When the host sends a 0x06 command, e.g. set PWM frequency, the next octet,
  * after the command is the actual PWM setting, we get this value and then use 
@@ -241,11 +1367,47 @@ static inline uint16_t irtoy_pwm_to_hz(uint8_t pwm_setting){
     return (uint16_t)((IRTOY_FREQ/(pwm_setting+1))/IRTOY_MULTIPLIER);
 }
 
-void PwmConfigure(uint16_t freq, uint16_t *timer1_pwm_val){
+#ifdef HW_PWM
+/** @brief Configure the PWM module (PWM2 on PIN_PWM) for the carrier. The
+ * period is fixed at 256 clocks, so only the clock divider can be chosen, 
+ * the closer one of the two dividers around the frequency is taken.
+ * 
+ * @param[in] freq - The desired pwm frequency in HZ
+ * @return the carrier frequency in HZ
+ */
+static uint16_t hwPwmConfigure(uint16_t freq){
+    uint16_t ck = HW_PWM_CLK / freq;
+    uint16_t above, below;
+
+    if (ck == 0) ck = 1;
+    if (ck > 255) ck = 255;
+    above = HW_PWM_CLK / ck;
+    below = HW_PWM_CLK / (ck + 1);
+    if (ck < 255 && above > freq && freq - below < above - freq) ck++;
+    PWM_CK_SE = ck;
+    PWM_write(PIN_PWM, PWM_DUTY_50);
+    PWM_pol_normal(PIN_PWM);
+    // Configure the PWM pin as output, low while the module is off
+    PIN_output(PIN_PWM);
+    PIN_low(PIN_PWM);
+    return HW_PWM_CLK / ck;
+}
+#endif
+
+uint16_t PwmConfigure(uint16_t freq, uint16_t *timer1_pwm_val){
+#ifdef HW_PWM
+#ifdef SOFT_PWM
+    if (carrierHw)
+#endif
+    {
+        return hwPwmConfigure(freq);
+    }
+#endif
+#ifdef SOFT_PWM
     //calculate the timer value that we need to set
     // timer1_pwm_val (half period duration) = (1/freq / 1/Timer_clock) / 2
     float target_period = (((1/((float)(freq)))/(SOFT_PWM_MIN_PER))/2.0F);
-    *timer1_pwm_val = (uint16_t)(target_period-SPWM_DRIFT);
+    *timer1_pwm_val = (uint16_t)(target_period-T1_RELOAD_DRIFT);
     // Invert the value which will later be set to timer 1 TH/TL regs
     *timer1_pwm_val = ~(*timer1_pwm_val);
     // Set timer1 High and Low SFRs
@@ -254,24 +1416,54 @@ void PwmConfigure(uint16_t freq, uint16_t *timer1_pwm_val){
     ET1 = 1; // Enable Timer 1 interrupt
     // Configure the PWM pin as output
     PIN_output(PIN_PWM);
+    // The half period is a whole number of timer ticks, T1_RELOAD_DRIFT included
+    return (uint16_t)(0.5F / SOFT_PWM_MIN_PER / (uint16_t)target_period);
+#endif
 }
 
-unsigned char getUnsignedCharArrayUsbUart(uint8_t *buffer, uint8_t len){
-   if(CDC_available())
-    {    
-       // DBG("count %d\n", CDC_readByteCount);
-        if(len > CDC_readByteCount)
-        {
-            len = CDC_readByteCount;
-        }
-       if(len != 0){ 
-        for (int i=0; i < len; i++){
-             buffer[i] = CDC_read_b();
-        }
-       }
-    return len;
+/** @brief Select the carrier backend (CARRIER_*) and answer with 'c', the
+ * backend in use, the frequency it makes and the error to the requested
+ * frequency (signed), both in HZ. The backend is only switched while the TX
+ * engine is idle.
+ * 
+ * @param[in] backend - The backend, any other value keeps the current one
+ */
+static void carrierSelect(uint8_t backend){
+    uint16_t freq = target_freq ? target_freq : PWM_FREQ;
+    uint16_t made;
+
+#if defined(SOFT_PWM) && defined(HW_PWM)
+    if (!txBusy && backend <= CARRIER_HW) {
+        carrierHw = backend == CARRIER_HW;
+    }
+    backend = carrierHw ? CARRIER_HW : CARRIER_SOFT;
+#elif defined(HW_PWM)
+    backend = CARRIER_HW;
+#else
+    backend = CARRIER_SOFT;
+#endif
+    target_freq = freq;
+    made = PwmConfigure(freq, timer1_pwm_ptr);
+    WaitInReady();
+    cdc_In_buffer = inWhich();
+    cdc_In_buffer[0] = 'c';
+    cdc_In_buffer[1] = backend;
+    cdc_In_buffer[2] = made >> 8;
+    cdc_In_buffer[3] = made;
+    cdc_In_buffer[4] = (made - freq) >> 8;
+    cdc_In_buffer[5] = made - freq;
+    CDC_writePointer += 6;
+    CDC_flush(); // flush the buffer 
+}
+
+/** @brief Hand the parsed EP2 OUT packet (cmdPacket) back to the USB, so that
+ * the host can send the next one */
+static void cmdRelease(void){
+    if (cmdHeld) {
+        cmdHeld = 0;
+        CDC_readByteCount = 0;
+        UEP2_CTRL = (UEP2_CTRL & ~MASK_UEP_R_RES)| UEP_R_RES_ACK;
     }
-   return 0;
 }
 
 void GetUsbIrdroidVersion(void) {
@@ -285,19 +1477,235 @@ void GetUsbIrdroidVersion(void) {
     CDC_flush(); // flush the buffer 
 }
 
+/** Features of this build (GetUsbIrdroidInfo) */
+#if defined(SOFT_PWM) && defined(HW_PWM)
+#define INFO_F_BACKENDS     INFO_F_CARRIER
+#define INFO_CARRIERS       ((1 << CARRIER_SOFT) | (1 << CARRIER_HW))
+#elif defined(HW_PWM)
+#define INFO_F_BACKENDS     0
+#define INFO_CARRIERS       (1 << CARRIER_HW)
+#else
+#define INFO_F_BACKENDS     0
+#define INFO_CARRIERS       (1 << CARRIER_SOFT)
+#endif
+#ifdef ASM_TIMER_ISR
+#define INFO_F_BUILD        (INFO_F_BACKENDS | INFO_F_ASM_ISR)
+#else
+#define INFO_F_BUILD        INFO_F_BACKENDS
+#endif
+#define INFO_FEATURES       (INFO_F_HANDSHAKE | INFO_F_CREDIT | INFO_F_REPEAT | INFO_F_DICT \
+                            | INFO_F_LIBRARY | INFO_F_PROTO | INFO_F_LONG_EDGE \
+                            | INFO_F_RX_OVERFLOW | INFO_F_UNITS | INFO_F_BUILD)
+
+/** @brief Write a 32-bit value big-endian
+ *
+ * @param[out] buf - The four bytes
+ * @param[in] value - The value
+ */
+static void infoPut32(uint8_t *buf, uint32_t value){
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+void GetUsbIrdroidInfo(void) {
+    uint32_t carrierMax;
+
+#ifdef SOFT_PWM
+    // the shortest half period is one tick on top of T1_RELOAD_DRIFT
+    carrierMax = (uint32_t)(0.5F / SOFT_PWM_MIN_PER / (T1_RELOAD_DRIFT + 1));
+#else
+    carrierMax = HW_PWM_CLK; // PWM_CK_SE = 1
+#endif
+    WaitInReady();
+    cdc_In_buffer = inWhich();
+    cdc_In_buffer[0] = 'I';
+    cdc_In_buffer[1] = INFO_LEN - 2;
+    cdc_In_buffer[2] = HARDWARE_VERSION;
+    cdc_In_buffer[3] = FIRMWARE_VERSION_H;
+    cdc_In_buffer[4] = FIRMWARE_VERSION_L;
+    cdc_In_buffer[5] = INFO_FEATURES >> 8;
+    cdc_In_buffer[6] = INFO_FEATURES & 0xFF;
+    cdc_In_buffer[7] = INFO_CARRIERS;
+    cdc_In_buffer[8] = (1 << IRS_RX_RAW) | (1 << IRS_RX_DECODE) | (1 << IRS_RX_TICKS)
+                     | (1 << IRS_RX_COMPACT);
+    cdc_In_buffer[9] = (1 << IRS_UNITS_IRTOY) | (1 << IRS_UNITS_TICKS);
+    cdc_In_buffer[10] = (1 << (IRPROTO_LAST + 1)) - 2; // IRPROTO_NEC..IRPROTO_LAST
+    cdc_In_buffer[11] = TX_RING_SIZE >> 8;
+    cdc_In_buffer[12] = TX_RING_SIZE & 0xFF;
+    cdc_In_buffer[13] = RX_RING_SIZE;
+    cdc_In_buffer[14] = TX_DICT_MAX;
+    cdc_In_buffer[15] = IRLIB_SLOTS;
+    infoPut32(&cdc_In_buffer[16], carrierMax);
+    infoPut32(&cdc_In_buffer[20], F_CPU);
+    cdc_In_buffer[24] = XDATA_RAM_SIZE >> 8;
+    cdc_In_buffer[25] = XDATA_RAM_SIZE & 0xFF;
+    cdc_In_buffer[26] = TX_RING_ADDR >> 8;
+    cdc_In_buffer[27] = TX_RING_ADDR & 0xFF;
+    CDC_writePointer += INFO_LEN;
+    CDC_flush(); // flush the buffer 
+}
+
+/** @brief Send the decoded frame record (irprotoRecord) to the host, right
+ * away, a record is never split across USB packets */
+static void rxSendRecord(void){
+    CDC_writeBlock(irprotoRecord, IRPROTO_RECORD_LEN);
+    CDC_flush(); // flush the buffer
+    while(CDC_writeBusyFlag);
+    cdc_In_buffer = inWhich();
+}
+
+/** @brief Send the number of captures the Timer2 ISR dropped on a full 
+ * receive ring since the last query, 'o' and the count (big-endian). Timer2
+ * is stopped while a command is parsed, so the count is read safely. */
+static void rxSendOverflows(void){
+    WaitInReady();
+    cdc_In_buffer = inWhich();
+    cdc_In_buffer[0] = 'o';
+    cdc_In_buffer[1] = (rxOverflows >> 8)&0xff;
+    cdc_In_buffer[2] = (rxOverflows & 0xff);
+    CDC_writePointer += 3;
+    CDC_flush(); // flush the buffer 
+    rxOverflows = 0;
+}
+
+/** @brief Select the duration units (IRIO_UNITS), an unknown value keeps the
+ * current ones. Answers 'u' [units], the units in effect, the raw receive 
+ * mode follows them.
+ * 
+ * @param[in] units - IRS_UNITS_IRTOY or IRS_UNITS_TICKS
+ */
+static void unitsSelect(uint8_t units){
+    if (units == IRS_UNITS_TICKS) {
+        txTicks = 1;
+        if (rxMode == IRS_RX_RAW) rxMode = IRS_RX_TICKS;
+    } else if (units == IRS_UNITS_IRTOY) {
+        txTicks = 0;
+        if (rxMode == IRS_RX_TICKS) rxMode = IRS_RX_RAW;
+    }
+    WaitInReady();
+    cdc_In_buffer = inWhich();
+    cdc_In_buffer[0] = 'u';
+    cdc_In_buffer[1] = txTicks ? IRS_UNITS_TICKS : IRS_UNITS_IRTOY;
+    CDC_writePointer += 2;
+    CDC_flush(); // flush the buffer 
+}
+
+/** @brief Queue one byte for the host, the IN buffer is sent when it is full */
+static void rxPutByte(uint8_t b){
+    *cdc_In_buffer++ = b;
+    if(++CDC_writePointer == MAX_PACKET_SIZE){
+        CDC_flush(); // flush the buffer
+        while(CDC_writeBusyFlag);
+        cdc_In_buffer = inWhich(); 
+    }
+}
+
+/** @brief Queue one big-endian word for the host */
+static void rxPutWord(uint16_t word){
+    rxPutByte((word >> 8) & 0xff);
+    rxPutByte(word);
+}
+
+/** @brief Queue one value in the IRS_RX_COMPACT short or long form */
+static void rxPutUnits(uint16_t units){
+    if(units <= RX_COMPACT_SHORT_MAX){
+        rxPutByte(units);
+    }else{
+        rxPutByte(RX_COMPACT_LONG);
+        rxPutWord(units);
+    }
+}
+
+/** @brief Send the pending run and mark of the IRS_RX_COMPACT encoder, before
+ * the IN buffer goes to the host at the end of a burst */
+static void rxCompactFlush(void){
+    if(rxRun){
+        rxPutByte(RX_COMPACT_RUN | rxRun);
+        rxRun = 0;
+    }
+    if(rxPend){
+        rxPutUnits(rxPendMark);
+        rxPend = 0;
+        rxPairValid = 0;
+    }
+}
+
+/** @brief IRS_RX_COMPACT encoder, one mark or space (rxMark) in irtoy units.
+ * The marks are held back until their space is known, a pair that repeats 
+ * the last one sent only increments the run count.
+ * 
+ * @param[in] units - The length of the edge, not 0
+ */
+static void rxCompact(uint16_t units){
+    if(rxMark){
+        if(rxPend) rxCompactFlush(); // an edge was lost, keep the order
+        rxPendMark = units;
+        rxPend = 1;
+    }else if(rxPend && rxPairValid && rxPendMark == rxPairMark && units == rxPairSpace){
+        rxPend = 0;
+        if(++rxRun == RX_COMPACT_RUN_MAX){
+            rxPutByte(RX_COMPACT_RUN | rxRun);
+            rxRun = 0;
+        }
+    }else{
+        if(rxRun){
+            rxPutByte(RX_COMPACT_RUN | rxRun);
+            rxRun = 0;
+        }
+        rxPairValid = rxPend;
+        if(rxPend){
+            rxPutUnits(rxPendMark);
+            rxPairMark = rxPendMark;
+            rxPairSpace = units;
+            rxPend = 0;
+        }
+        rxPutUnits(units);
+    }
+    rxMark = !rxMark;
+}
+
+/** @brief Reset the IRS_RX_COMPACT encoder, nothing pending */
+static void rxCompactReset(void){
+    rxRun = 0;
+    rxPend = 0;
+    rxPairValid = 0;
+}
+
 void irsSetup(void) {
-    irS.rxflag = 0;
-    irS.txflag = 0;
-    irS.flushflag = 0;
+    rxHead = 0;
+    rxTail = 0;
+    rxOverflows = 0;
+    rxFrac = 0;
+    rxMode = IRS_RX_RAW;
+    txTicks = 0;
+    rxMark = 1;
+    rxCompactReset();
+    irprotoDecodeReset();
+    txLast = 0;
+    txError = 0;
+    txFrames = 0;
+    txFails = 0;
+    txHead = 0;
+    txTail = 0;
+    txEnd = 0;
+    txFrameStart = 0;
+    txFrameEntries = 0;
+    txStaged = 0;
+    txPacketEnd = 0;
+    txLong = 0;
+    txLoops = 0;
+    txGapLeft = 0;
+    rxFlush = 0;
     irS.timeout = 0;
     irS.t2_count = 0;
-    irS.irSignal = 0;
     irS.TXsamples = 0;
-    irS.TX = 0;
     irS.overflow = 0;
     irS.sendcount = 0;
     irS.sendfinish = 0;
     irS.handshake = 0;
+    irS.credit = 0;
     irS.RXcompleted = 0;
     if(target_freq == 0){
         PwmConfigure(PWM_FREQ, timer1_pwm_ptr);
@@ -311,267 +1719,316 @@ void irsSetup(void) {
     CDC_flush(); 
     while(CDC_writeBusyFlag);
     cdc_In_buffer = inWhich(); 
-    EX0 = 1;    // Enable INT0 (RX Mode)
+    rxEnable(); // Enable INT0 (RX Mode)
 }
 
 unsigned char irsService(void)
 {   
-    static _smio irIOstate = I_IDLE;
-    static unsigned int txcnt = 0;
-    static unsigned char i = 0;
+    uint16_t irSignal;
+    uint8_t periods, len;
 
-    if (irS.TXsamples == 0) {
-        irS.TXsamples = getUnsignedCharArrayUsbUart(irToy.s, MAX_PACKET_SIZE);
+    // All queued frames are out, tell the host
+    if (txFrames && !txBusy) {
+        txComplete();
+    }
+    if (irIOstate == I_TX_STATE) {
+        txService();
+    } else if (irIOstate == I_PROTO_STATE) {
+        protoService(protoCarrier);
+    } else if (irIOstate == I_LIB_STATE) {
+        libService();
+    } else if (irIOstate == I_DICT_STATE) {
+        dictService();
+    } else if (irS.TXsamples == 0 && CDC_available()) {
+        // Take the next packet of commands, it is parsed straight out of the 
+        // EP2 OUT buffer and the host gets no more data until cmdRelease()
+        cmdPacket = OutWhich();
+        cmdHeld = 1;
+        irS.TXsamples = CDC_readByteCount;
         TxBuffCtr = 0;
     }
 
     if (irS.TXsamples > 0) {
         EX0 = 0;
-        DISABLE_TIMER2();
+        rxStop();
         EXF2 = 0;
-        switch (irIOstate) { 
-            case I_IDLE:
-                switch (irToy.s[TxBuffCtr]) {
-                    case IRIO_TRANSMIT_unit: //start transmitting
-                        txcnt = 0; //reset transmit byte counter, used for diagnostic
-                        ET0 = 0; // Disable Timer 0 interrupt
-                        TR0 = 0; //enable the timer
-                        irS.TX = 0;
-                      
-                        irS.txflag = 0; //transmit flag =0 reset the transmit flag
-                        irIOstate = I_TX_STATE; //change to transmit data processing state
-						tmr0_buf[2]=0x00; //last data packet flag
-						irS.txerror=0; //reset error message
-                        LedOff();
-                        IE_USB = 0;
-                        if (irS.handshake) {
-                            cdc_In_buffer = inWhich();
-                            UEP2_CTRL = (UEP2_CTRL & ~MASK_UEP_R_RES)| UEP_R_RES_ACK; 
-                            WaitInReady();
-                            cdc_In_buffer[0] = MAX_PACKET_SIZE;
-                            CDC_writePointer += sizeof(uint8_t); // Increment the write counter
-                            CDC_flush(); // flush the buffer 
-                        }      
-                        
-                        do {
-                            
-                            irS.TXsamples = getCDC_Out_ArmNext();
-                            OutPtr = OutWhich();   
-                            if (irS.TXsamples) { // host may have sent a ZLP skip transmit if so.
-                                       
-                                        // Ask for more bytes
-                                        UEP2_CTRL = (UEP2_CTRL & ~MASK_UEP_R_RES)| UEP_R_RES_ACK;  
-                                        // Ask the host to send us 62 bytes
-                                        if (irS.handshake) {
-                                            cdc_In_buffer = inWhich();
-                                            WaitInReady();
-                                            cdc_In_buffer[0] = MAX_PACKET_SIZE;
-                                            CDC_writePointer += sizeof(uint8_t); // Increment the write counter
-                                            CDC_flush(); // flush the buffer 
-                                            fast_usb_handler(); 
-                                            fast_usb_handler(); 
-                                        }                  
-                                    
-                                for (i = 0; i < irS.TXsamples; i += 2, OutPtr += 2) {
-
-                                    // JTR 3 The idea here is to preprocess the "OVERHEAD"
-                                    // In what is otherwise dead time. I.E. waiting for the
-                                    // IR Tx Timer to timeout.
-                                    //check here for 0xff 0xff and return to IDLE state        
-
-                                    if (((*(OutPtr) == 0xff) && (*(OutPtr + 1)) == 0xff)) {
-										tmr0_buf[2]=0xff; //flag end of data
-                                        irIOstate = I_LAST_PACKET;
-                                        i = irS.TXsamples;
-                                        *(OutPtr + 1) = 0; // JTR3 replace 0xFFFF with 0020 (Ian's value)
-                                        *(OutPtr) = 40;
-                                        // Check if this need to be here
-                                        CDC_readByteCount = 0;
-                                    }
-
-                                    align_irtoy_ch552(*OutPtr, *(OutPtr+1), OutPtr);
-
-                                    // This cute code calculates the two's compliment (subtract from zero)
-                                    // The quick way to do this in invert and add 1.
-                                    *OutPtr = ~*OutPtr;
-                                    *(OutPtr + 1) = ~*(OutPtr + 1);
-
-                                    *(OutPtr + 1) += 1;
-                                    if (*(OutPtr + 1) == 0) // did we get rollover in LSB?
-                                        *(OutPtr) += 1; // then must add the carry to MSB
-
-                                    while (irS.txflag == 1){
-                                        fast_usb_handler(); 
-                                    }
-                                   
-                                    tmr0_buf[1] = *(OutPtr); //put the second byte in the buffer
-                                    tmr0_buf[0] = *(OutPtr + 1); //put the first byte in the buffer
-                                    
-                                    txcnt += 2; //total bytes transmitted
-                                    // Decrement the number of bytes read
-                                    //CDC_readByteCount -= 2;
-
-                                    if (irS.TX == 0) {//enable interrupt if this is the first time
-                                        fast_usb_handler(); 
-                                        irS.TX = 1;
-                                        TH0 = tmr0_buf[1]; //first set the high byte
-                                        TL0 = tmr0_buf[0]; //set low byte copies high byte too
-                                       
-                                        TF0 = 0; // Clear the interrupt flag of timer 0
-                                        ET0 = 1; // Enable Timer 0 interrupt
-                                        TR0 = 1; //enable the timer
-                                        //enable the PWM
-                                        PWMon();
-                                        irS.TXInvert = IRS_TRANSMIT_LO;
-                                        LedOn();
-                                    }else{
-										//only set AFTER 1st packet or the first packet is sent twice
-                                    	irS.txflag = 1; //reset the interrupt buffer full flag
-									}
-
-                                    if (irIOstate == I_LAST_PACKET)
-                                        break;
-                                }//for
-                            }
-                        } while (irIOstate != I_LAST_PACKET);
-
-                        irIOstate = I_IDLE;
-                        IE_USB = 1;
-                        if (irS.sendcount) { //return the total number of bytes transmitted if required
-                            WaitInReady();
-                            cdc_In_buffer = inWhich();
-                            cdc_In_buffer[0] = 't';
-                            cdc_In_buffer[1] = (txcnt >> 8)&0xff;
-                            cdc_In_buffer[2] = (txcnt & 0xff);
-                            CDC_writePointer += 3;
-                            CDC_flush(); // flush the buffer 
-                        }
-                        while (irS.txflag == 1){
-                            fast_usb_handler(); 
-                        }
-                        LedOff();
-                        if (irS.sendfinish) { // Really redundant giving we can send a count above.
-                            WaitInReady();
-                            cdc_In_buffer = inWhich();
-                            cdc_In_buffer[0] = 'C';
-							if(irS.txerror) cdc_In_buffer[0] = 'F';
-                            CDC_writePointer += 1;
-                            CDC_flush(); // flush the buffer 
-                            //USB_interrupt();
-                        }
-                        
-                        irS.TXsamples = 1; //will be zeroed at end, super hack yuck!  //JTR3 super yuck!
-                       
-                        break;
-                    
-                    case IRIO_RESET: //reset, return to RC5 (same as SUMP)
-                        LedOff();
-                        DBG("IR Reset %x\n", irToy.s[TxBuffCtr]);
-                        return 1; //need to flag exit!
-                        break;
-
-                    case IRIO_FREQ:
-                        break;
-                    case IRIO_LEDMUTEON:
-                        break;
-                    case IRIO_LEDMUTEOFF:
-                        break;
-                    case IRIO_LEDON:
-                        LedOn();
-                        break;
-                    case IRIO_LEDOFF:
-                        LedOff();
-                        break;
-                    case IRIO_HANDSHAKE:
-                        DBG("HANDSHAKE %x\n", irToy.s[TxBuffCtr]);
-                        irS.handshake = 1;
-                        EX0 = 1;    // Enable INT0 (RX Mode)
-                        break;
-                    case IRIO_NOTIFYONCOMPLETE:
-                        DBG("NOTIFY COMPLETE %x\n", irToy.s[TxBuffCtr]);
-                        irS.sendfinish = 1;
-                        EX0 = 1;    // Enable INT0 (RX Mode)
-                        break;
-                    case IRIO_GETCNT:
+        // Parse the whole packet in place, until a command hands over to one
+        // of the TX states
+        while (irS.TXsamples > 0 && irIOstate == I_IDLE) {
+            switch (cmdPacket[TxBuffCtr]) {
+                case IRIO_TRANSMIT_unit: //start transmitting
+                    cmdRelease(); // the rest of the packet is dropped, the samples follow
+                    txNewFrame();
+                    txFrac = 0;
+                    txLast = 0; //last data packet flag
+                    irIOstate = I_TX_STATE; //change to transmit data processing state
+                    txCredits = 0; // the credits of the last frame expired
+                    if (irS.credit) {
+                        UEP2_CTRL = (UEP2_CTRL & ~MASK_UEP_R_RES)| UEP_R_RES_ACK; 
                         WaitInReady();
+                        txCreditService();
+                    } else if (irS.handshake) {
                         cdc_In_buffer = inWhich();
-                        cdc_In_buffer[0] = 't';
-                        cdc_In_buffer[1] = (txcnt >> 8)&0xff;
-                        cdc_In_buffer[2] = (txcnt & 0xff);
-                        CDC_writePointer += 3;
+                        UEP2_CTRL = (UEP2_CTRL & ~MASK_UEP_R_RES)| UEP_R_RES_ACK; 
+                        WaitInReady();
+                        cdc_In_buffer[0] = MAX_PACKET_SIZE;
+                        CDC_writePointer += sizeof(uint8_t); // Increment the write counter
                         CDC_flush(); // flush the buffer 
-                        EX0 = 1;    // Enable INT0 (RX Mode)
+                    }      
+                    irS.TXsamples = 1; //will be zeroed at end, the rest of the packet is dropped
+                    break;
+                
+                case IRIO_TRANSMIT_PROTO: //synthesize a protocol code
+                    if (irS.TXsamples <= IRPROTO_PARAM_LEN) {
+                        irS.TXsamples = 1; // incomplete command, drop it
                         break;
-                    case IRIO_RETURNTXCNT:
-                        irS.sendcount = 1;
-                        EX0 = 1;    // Enable INT0 (RX Mode)
+                    }
+                    protoCarrier = irprotoSetup(&cmdPacket[TxBuffCtr + 1]);
+                    if (protoCarrier) {
+                        txNewFrame();
+                        irIOstate = I_PROTO_STATE;
+                    }
+                    TxBuffCtr += IRPROTO_PARAM_LEN;
+                    irS.TXsamples -= IRPROTO_PARAM_LEN;
+                    break;
+
+                case IRIO_TRANSMIT_DICT: //a frame packed with a duration dictionary
+                    len = dictSetup(&cmdPacket[TxBuffCtr + 1], irS.TXsamples - 1);
+                    if (len == 0) {
+                        irS.TXsamples = 1; // incomplete command, drop it
                         break;
-                    case IRIO_SETUP_PWM:
+                    }
+                    txNewFrame();
+                    txFrac = 0;
+                    irIOstate = I_DICT_STATE;
+                    TxBuffCtr += len;
+                    irS.TXsamples -= len;
+                    break;
+
+                case IRIO_RX_MODE: //select raw or decoded reception
+                    if (irS.TXsamples > 1) {
+                        TxBuffCtr++;
+                        irS.TXsamples--;
+                        if (cmdPacket[TxBuffCtr] <= IRS_RX_COMPACT) {
+                            rxMode = cmdPacket[TxBuffCtr];
+                        }
+                        rxMark = 1;
+                        rxCompactReset();
+                        irprotoDecodeReset();
+                    }
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+
+                case IRIO_LIB_STORE: //store the last frame in the library
+                    if (irS.TXsamples > 1) {
                         TxBuffCtr++;
+                        irS.TXsamples--;
+                        WaitInReady();
+                        cdc_In_buffer = inWhich();
+                        cdc_In_buffer[0] = libStore(cmdPacket[TxBuffCtr]) ? 'C' : 'F';
+                        CDC_writePointer += 1;
+                        CDC_flush(); // flush the buffer
+                    }
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+
+                case IRIO_TX_REPEAT: //repeat the last frame
+                    if (irS.TXsamples > 3) {
+                        txRepeat(cmdPacket[TxBuffCtr + 1],
+                                 ((uint16_t)cmdPacket[TxBuffCtr + 2] << 8) | cmdPacket[TxBuffCtr + 3]);
+                        TxBuffCtr += 3;
+                        irS.TXsamples -= 3;
+                    } else {
+                        irS.TXsamples = 1; // incomplete command, drop it
+                    }
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+
+                case IRIO_RX_OVERFLOW: //report the dropped captures
+                    rxSendOverflows();
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+
+                case IRIO_UNITS: //select irtoy units or ticks
+                    if (irS.TXsamples > 1) {
+                        TxBuffCtr++;
+                        irS.TXsamples--;
+                        unitsSelect(cmdPacket[TxBuffCtr]);
+                    }
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+
+                case IRIO_CARRIER: //select the carrier backend
+                    if (irS.TXsamples > 1) {
+                        TxBuffCtr++;
+                        irS.TXsamples--;
+                        carrierSelect(cmdPacket[TxBuffCtr]);
+                    }
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+
+                case IRIO_RESET: //reset, return to RC5 (same as SUMP)
+                    LedOff();
+                    DBG("IR Reset %x\n", cmdPacket[TxBuffCtr]);
+                    cmdRelease();
+                    return 1; //need to flag exit!
+                    break;
+
+                case IRIO_FREQ:
+                    break;
+                case IRIO_LEDMUTEON:
+                    break;
+                case IRIO_LEDMUTEOFF:
+                    break;
+                case IRIO_LEDON:
+                    LedOn();
+                    break;
+                case IRIO_LEDOFF:
+                    LedOff();
+                    break;
+                case IRIO_HANDSHAKE:
+                    DBG("HANDSHAKE %x\n", cmdPacket[TxBuffCtr]);
+                    irS.handshake = 1;
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+                case IRIO_TX_CREDIT:
+                    irS.credit = 1;
+                    irS.handshake = 0;
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+                case IRIO_NOTIFYONCOMPLETE:
+                    DBG("NOTIFY COMPLETE %x\n", cmdPacket[TxBuffCtr]);
+                    irS.sendfinish = 1;
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+                case IRIO_GETCNT:
+                    txSendCount();
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+                case IRIO_RETURNTXCNT:
+                    irS.sendcount = 1;
+                    rxEnable(); // Enable INT0 (RX Mode)
+                    break;
+                case IRIO_SETUP_PWM:
+                    TxBuffCtr++;
 						/* Check if we have a command to jump to the bootloader */
-                        if(irToy.s[TxBuffCtr] == 0xff){
-                        	DBG("BOOT");
-                        	WDT_start();
-                        	while(1); 
-                        }else{
+                    if(cmdPacket[TxBuffCtr] == 0xff){
+                    	DBG("BOOT");
+                    	WDT_start();
+                    	while(1); 
+                    }else{
 							/** Convert Irtoy PWM setting to HZ */
-							target_freq = irtoy_pwm_to_hz(irToy.s[TxBuffCtr]);
+							target_freq = irtoy_pwm_to_hz(cmdPacket[TxBuffCtr]);
 							DBG("Frequency(Hz): %u\n", freq)
 							/* Configure the software PWM setting for the desired frequency */
 							PwmConfigure(target_freq, timer1_pwm_ptr);
-                            EX0 = 1;    // Enable INT0 (RX Mode)
+                        rxEnable(); // Enable INT0 (RX Mode)
 						}
-                        irS.TXsamples -=2;
-                        break;
-                    case CUSTOM_FF:
-                        LedOff();
-                        DBG("IR Reset %x\n", irToy.s[TxBuffCtr]);
-                        return 1; //need to flag exit!
-                    default:
-                        break;
-                }
-                irS.TXsamples--;
-                TxBuffCtr++;
-            break;
-        }   
-    
+                    // the duty cycle byte is not used
+                    if (irS.TXsamples > 2) {
+                        irS.TXsamples -= 2;
+                        TxBuffCtr++;
+                    } else {
+                        irS.TXsamples = 1;
+                    }
+                    break;
+                case CUSTOM_FF:
+                    LedOff();
+                    DBG("IR Reset %x\n", cmdPacket[TxBuffCtr]);
+                    cmdRelease();
+                    return 1; //need to flag exit!
+                default:
+                    if ((cmdPacket[TxBuffCtr] & ~IRLIB_SLOT_MASK) == IRIO_LIB_PLAY) {
+                        //replay a library slot, no payload
+                        txNewFrame();
+                        libSlot = cmdPacket[TxBuffCtr] & IRLIB_SLOT_MASK;
+                        irIOstate = I_LIB_STATE;
+                    }
+                    break;
+            }
+            irS.TXsamples--;
+            TxBuffCtr++;
+        }
+        if (irS.TXsamples == 0) {
+            cmdRelease();
+        }
     }
     // If we have pulse-space measuremnts available, put them in the CDC buffer
-    if(irS.rxflag == 1){
-      irS.rxflag = 0;
-      irS.irSignal = _divuint(irS.irSignal,TIMER_0_CONST);
-      if(irS.irSignal!=0){
-      *cdc_In_buffer++ = (irS.irSignal >> 8) & 0xff;
-      *cdc_In_buffer++ = irS.irSignal;
-      CDC_writePointer += sizeof(uint16_t);
+    while(rxTail != rxHead){
+      irSignal = (rxRingH[rxTail & (RX_RING_SIZE - 1)] << 8) | rxRingL[rxTail & (RX_RING_SIZE - 1)];
+      periods = rxRingP[rxTail & (RX_RING_SIZE - 1)];
+      rxTail++; // the ISR may reuse the entry now
+      if(periods == 0){
+        if(rxMode == IRS_RX_DECODE){
+          // Decoded mode, only the recognized frames go to the host
+          if(irprotoDecode(rxMark, irSignal)){
+            rxSendRecord();
+          }
+          rxMark = !rxMark;
+        }else if(rxMode == IRS_RX_TICKS){
+          // Raw Timer2 ticks, 0xFFFF is the end of data marker
+          rxPutWord(irSignal == 0xFFFF ? 0xFFFE : irSignal);
+        }else if(rxMode == IRS_RX_COMPACT){
+          irSignal = scale_ch552_irtoy(irSignal);
+          rxCompact(irSignal ? irSignal : 1); // keep the mark/space order
+        }else{
+          irSignal = scale_ch552_irtoy(irSignal);
+          if(irSignal!=0){
+            rxPutWord(irSignal);
+          }
+        }
+      }else{
+        rxFrac = 0; // a new burst starts after the gap
+        if(rxMode == IRS_RX_DECODE){
+            if(irprotoDecodeGap(periods, irSignal)) rxSendRecord();
+        }else if(rxMode == IRS_RX_TICKS){
+            // 0x0000 escape, the whole Timer2 periods and the ticks after them
+            rxPutWord(0);
+            rxPutWord(periods);
+            rxPutWord(irSignal);
+        }else if(rxMode == IRS_RX_COMPACT){
+            rxCompact(scale_gap_irtoy(periods, irSignal));
+        }else{
+            rxPutWord(scale_gap_irtoy(periods, irSignal));
+        }
+        rxMark = 1; // the gap ends with the start of a mark
       }
     }
-    if(irS.gap == 1){
-        irS.gap = 0;
-       *cdc_In_buffer++ = (irS.irSignal >> 8) & 0xff;
-       *cdc_In_buffer++ = irS.irSignal;
-       CDC_writePointer += sizeof(uint16_t); 
-    }
-    if(CDC_writePointer == MAX_PACKET_SIZE){
-        CDC_flush(); // flush the buffer
-        while(CDC_writeBusyFlag);
-        cdc_In_buffer = inWhich(); 
-    }
-    if(irS.flushflag == 1){
+    if(rxFlush){
       // Flush any pending bytes in the USB send buffer
-      irS.flushflag = 0;
+      rxFlush = 0;
+      if(rxMode == IRS_RX_DECODE && irprotoDecodeEnd()){
+        rxSendRecord(); // the silence ends the frame
+      }
+      if(rxMode == IRS_RX_COMPACT){
+        rxCompactFlush();
+      }
       CDC_flush(); // flush the buffer
       while(CDC_writeBusyFlag);
       cdc_In_buffer = inWhich(); 
     }
     if(irS.RXcompleted == 1){
       irS.RXcompleted = 0;
-      DISABLE_TIMER2();
-      // RX is completed, send the packet terminator
-      *cdc_In_buffer++ = 0xFF;
-      *cdc_In_buffer++ = 0xFF;
-      CDC_writePointer += sizeof(uint16_t);
-      CDC_flush(); // flush the buffer
+      rxStop();
+      rxMark = 1;
+      if(rxMode == IRS_RX_DECODE){
+        // The records are complete by themselves, no terminator
+        if(irprotoDecodeEnd()) rxSendRecord();
+        irprotoDecodeReset();
+      }else if(rxMode == IRS_RX_COMPACT){
+        // RX is completed, send the long form terminator
+        rxCompactFlush();
+        rxPairValid = 0;
+        rxPutByte(RX_COMPACT_LONG);
+        rxPutWord(0xFFFF);
+        CDC_flush(); // flush the buffer
+      }else{
+        // RX is completed, send the packet terminator
+        *cdc_In_buffer++ = 0xFF;
+        *cdc_In_buffer++ = 0xFF;
+        CDC_writePointer += sizeof(uint16_t);
+        CDC_flush(); // flush the buffer
+      }
     } 
     return 0;
 }
\ No newline at end of file
@@ -13,14 +13,96 @@
  * match the irtoy time unit*/
 #ifdef TIMER_CLOCK_FAST
 #define TIMER_0_CONST 128 /* We are using 6MHz timer clock */
+#define TIMER_0_DEN 1
 #else
 #define TIMER_0_CONST 43 /* We are using a 2MHz timer clock*/
+#define TIMER_0_DEN 3
 #endif
+/** The exact length of one irtoy time unit is TIMER_0_NUM/TIMER_0_DEN timer 
+ * ticks (128/3 = 42.667 at 2MHz), TIMER_0_CONST is that value rounded up, so 
+ * it is 1/TIMER_0_DEN tick too long per unit. */
+#define TIMER_0_NUM 128
+#define TIMER_0_NUM_SHIFT 7
+/** A whole Timer2 period (65536 ticks, same clock as Timer0) in irtoy units */
+#define TIMER_2_PERIOD_UNITS ((uint16_t)(65536UL * TIMER_0_DEN / TIMER_0_NUM))
+/** Timer0 ticks per microsecond (one irtoy unit is 64/3 us) */
+#define TIMER_0_TICKS_PER_US (TIMER_0_NUM * 3 / TIMER_0_DEN / 64)
+
+/** Transmit ring buffer with precomputed Timer0 reload values. It is placed in
+ * the free XRAM above the USB endpoint buffers, the low and the high bytes are
+ * kept in two page aligned 256 byte arrays, so that the 8-bit ring indexes wrap
+ * around by themselves. XRAM_LOC/XRAM_SIZE in the makefile must stay below it.*/
+#define TX_RING_ADDR    0x0200
+#define TX_RING_SIZE    256
+/** The Timer0 TX engine is started when that many edges are queued (or the
+ * whole frame is already in the ring) */
+#define TX_RING_LOW_WM  64
+/** Edges in a full EP2 OUT packet of 2 byte samples */
+#define TX_PACKET_EDGES (MAX_PACKET_SIZE / 2)
+/** An extended edge in the irtoy sample stream, 0x0000 [periods] [ticks], is
+ * periods * 65536 + ticks Timer0 ticks (0.5us), the gap format of IRS_RX_TICKS.
+ * Up to TX_LONG_PERIODS_MAX whole Timer0 periods (about 8.4s), longer ones 
+ * are cut. In the ring it takes TX_LONG_ENTRIES entries, 0x0000, the whole 
+ * periods (low byte) and the reload value of the rest, the Timer0 ISR chains 
+ * the periods. A plain reload value of 0x0000 is queued as 0x0001. */
+#define TX_LONG_PERIODS_MAX 255
+#define TX_LONG_ENTRIES     3
+/** No more EP2 OUT packets are taken from the host above that ring level, an
+ * extended edge started in the previous packet may add two entries */
+#define TX_RING_HIGH_WM (TX_RING_SIZE - 1 - TX_PACKET_EDGES - (TX_LONG_ENTRIES - 1))
+/** IRIO_TX_CREDIT, the host gets more credits once that many packets fit */
+#define TX_CREDIT_MIN   2
+
+/** IRIO_TRANSMIT_DICT [n] [n durations H L] [edges] [symbols], a frame of
+ * 2..TX_DICT_MAX distinct durations (irtoy units). The symbols are indexes
+ * into the durations, 2 bits each (n <= 4) or 4 bits, first edge in the 
+ * most significant bits. No 0xFFFF terminator, the frame ends after the 
+ * edges, all of it must be in the same EP2 OUT packet. */
+#define TX_DICT_MAX     16
+
+/** Receive ring between the Timer2 ISR and the main loop (3 bytes per entry
+ * in the XRAM the compiler places), a power of two */
+#define RX_RING_SIZE    32
+
+/** Receive modes (IRIO_RX_MODE) */
+#define IRS_RX_RAW      0 // irtoy compatible mark/space timings (default)
+#define IRS_RX_DECODE   1 // decoded frame records only, see irproto.h
+#define IRS_RX_TICKS    2 // raw Timer2 ticks (0.5us), a gap is 0x0000 [periods] [ticks]
+#define IRS_RX_COMPACT  3 // irtoy units, variable length, see RX_COMPACT_*
+
+/** Duration units (IRIO_UNITS) of the IRIO_TRANSMIT samples, the 
+ * IRIO_TRANSMIT_DICT durations, the IRIO_TX_REPEAT gap and the raw receive
+ * mode. In ticks they are copied, not scaled, the 0xFFFF end of data marker 
+ * and the 0x0000 extended edge escape stay. */
+#define IRS_UNITS_IRTOY 0 // 21.333us irtoy units (default)
+#define IRS_UNITS_TICKS 1 // 0.5us Timer0/Timer2 ticks, the raw mode is IRS_RX_TICKS
+
+/** IRS_RX_COMPACT encoding. A value up to RX_COMPACT_SHORT_MAX units is one
+ * byte, a longer one is RX_COMPACT_LONG [H] [L]. RX_COMPACT_RUN | n repeats 
+ * the last mark/space pair n more times. RX_COMPACT_LONG 0xFF 0xFF ends the 
+ * data, as 0xFFFF does in the IRS_RX_RAW mode. */
+#define RX_COMPACT_SHORT_MAX    0x7F
+#define RX_COMPACT_LONG         0x80
+#define RX_COMPACT_RUN          0xC0
+#define RX_COMPACT_RUN_MAX      0x3F
 
 #define PWM_DUTY_50 128 // PWM Duty cycle constant for 50% Duty cycle
 #define LED_PIN P15 // Macro for the LED PIN
 
 #ifndef SOFT_PWM
+#define HW_PWM // the PWM module is the only carrier backend
+#endif
+/** Carrier backends (IRIO_CARRIER) */
+#define CARRIER_SOFT    0 // Timer1 interrupt toggles the pin, exact frequency
+#define CARRIER_HW      1 // PWM2 module, Fsys/256/PWM_CK_SE, no interrupts
+/** The PWM module counts 256 clocks per period */
+#define HW_PWM_CLK      (F_CPU / 256)
+
+#if defined(SOFT_PWM) && defined(HW_PWM)
+extern __bit carrierHw; // CARRIER_HW backend selected
+#define PWMon() if (carrierHw) {PWM_start(PIN_PWM);} else {TR1 = 1;ET1=1;}
+#define PWMoff() if (carrierHw) {PWM_stop(PIN_PWM);} else {TR1 = 0;ET1=0;} PIN_low(PIN_PWM);
+#elif defined(HW_PWM)
 #define PWMon() PWM_start(PIN_PWM); // Macro to turn on the PWM
 #define PWMoff() PWM_stop(PIN_PWM); // Macro to turn off the PWM
 #else
@@ -28,6 +110,23 @@
 #define PWMoff() TR1 = 0;ET1=0;PIN_low(PIN_PWM);  
 #endif
 
+/** The Timer0 and Timer1 interrupt routines are also written in assembly for
+ * SDCC, see irs.c. The assembly drives PWM2 on P3.4 as the hardware carrier.
+ * ASM_ISR in config.h selects them, else the C callbacks run (the host
+ * simulator uses those too). */
+#if defined(__SDCC) && defined(ASM_ISR)
+#define ASM_TIMER_ISR
+#endif
+
+/** Timer1 ticks the soft PWM reload misses. The C callback writes the reload
+ * late by the interrupt latency. The assembly routine adds the reload to the
+ * count, so only the ticks while Timer1 is stopped for the add are missed. */
+#ifdef ASM_TIMER_ISR
+#define T1_RELOAD_DRIFT     3
+#else
+#define T1_RELOAD_DRIFT     SPWM_DRIFT
+#endif
+
 #define LedOn() PIN_high(LED_PIN); // Turn On the Blue LED
 #define LedOff() PIN_low(LED_PIN); // Turn On the Blue LED
 #define LedToggle() PIN_toggle(LED_PIN); // Toggle the Blue LED
@@ -56,9 +155,40 @@
 #define IRIO_UART_CLOSE		    0x41
 #define IRIO_UART_WRITE		    0x42
 #define IRIO_IRW_FREQ           0x43
+#define IRIO_TRANSMIT_PROTO     0x50 // Irdroid: synthesize a protocol code, see irproto.h
+#define IRIO_RX_MODE            0x51 // Irdroid: followed by the IRS_RX_* receive mode
+#define IRIO_LIB_STORE          0x52 // Irdroid: store the last frame in a slot, see irlib.h
+#define IRIO_TX_REPEAT          0x53 // Irdroid: [count] [gap H] [gap L], repeat the last frame
+#define IRIO_CARRIER            0x54 // Irdroid: [CARRIER_*] select the carrier backend
+#define IRIO_RX_OVERFLOW        0x55 // Irdroid: answers 'o' [H] [L], captures lost on a full RX ring
+#define IRIO_TRANSMIT_DICT      0x56 // Irdroid: a packed frame in one packet, see TX_DICT_MAX
+#define IRIO_TX_CREDIT          0x57 // Irdroid: credits (packets) instead of the handshake
+#define IRIO_UNITS              0x58 // Irdroid: [IRS_UNITS_*] duration units, answers 'u' [units]
+#define IRIO_LIB_PLAY           0x80 // Irdroid: 0x80 | slot, transmit a library slot
 #define CDC_DESC                0x22
 #define CUSTOM_FF               0xff
 
+/** Device information (GetUsbIrdroidInfo), one IN packet, big-endian:
+ * 'I' [INFO_LEN - 2] [HW] [FW H] [FW L] [INFO_F_* H] [INFO_F_* L]
+ * [carriers, 1 << CARRIER_*] [receive modes, 1 << IRS_RX_*] 
+ * [units, 1 << IRS_UNITS_*] [protocols, 1 << IRPROTO_*]
+ * [TX_RING_SIZE H L] [RX_RING_SIZE] [TX_DICT_MAX] [IRLIB_SLOTS]
+ * [highest carrier in Hz, 4 bytes] [F_CPU, 4 bytes]
+ * [XDATA_RAM_SIZE H L] [TX_RING_ADDR H L]
+ * New fields are appended, a host skips what it does not know by the length. */
+#define INFO_LEN            28
+#define INFO_F_HANDSHAKE    0x0001 // IRIO_HANDSHAKE
+#define INFO_F_CREDIT       0x0002 // IRIO_TX_CREDIT
+#define INFO_F_REPEAT       0x0004 // IRIO_TX_REPEAT
+#define INFO_F_DICT         0x0008 // IRIO_TRANSMIT_DICT
+#define INFO_F_LIBRARY      0x0010 // IRIO_LIB_STORE and IRIO_LIB_PLAY
+#define INFO_F_PROTO        0x0020 // IRIO_TRANSMIT_PROTO
+#define INFO_F_LONG_EDGE    0x0040 // the 0x0000 extended edge escape
+#define INFO_F_RX_OVERFLOW  0x0080 // IRIO_RX_OVERFLOW
+#define INFO_F_CARRIER      0x0100 // IRIO_CARRIER, more than one carrier backend
+#define INFO_F_UNITS        0x0200 // IRIO_UNITS
+#define INFO_F_ASM_ISR      0x0400 // Timer0 and Timer1 routines in assembly (ASM_TIMER_ISR)
+
 typedef enum { //in out data state machine
     I_IDLE = 0,
     I_PARAMETERS,
@@ -66,7 +196,10 @@ typedef enum { //in out data state machine
     I_DATA_L,
     I_DATA_H,
     I_TX_STATE,
-    I_LAST_PACKET //JTR3 New! For 0x07 command
+    I_LAST_PACKET, //JTR3 New! For 0x07 command
+    I_PROTO_STATE, // protocol synthesizer feeds the TX ring
+    I_LIB_STATE,   // a library slot is copied to the TX ring
+    I_DICT_STATE   // a dictionary frame is expanded to the TX ring
 } _smio;
 
 // ============================================================================
@@ -76,37 +209,55 @@ typedef enum { //in out data state machine
 /** @brief Send the USB Infrared Tranceiver version information to the host */
 void GetUsbIrdroidVersion(void);
 
+/** @brief Send the device information to the host in one packet, the
+ * versions, the INFO_F_* features and the limits, see INFO_LEN */
+void GetUsbIrdroidInfo(void);
+
 /** @brief Setup for IR sampling mode; Timer, PWM etc. */
 void irsSetup(void);
 
 /** @brief Ir service routine */
 unsigned char irsService(void);
 
-/** @brief Copy the data from the CDC Out buffer to another buffer in 
- * the memory
+/** @brief Queue one edge (mark or space, they alternate) in the transmit 
+ * ring, used by the protocol synthesizer
+ * 
+ * @param[in] ticks - The length of the edge in Timer0 ticks
+ */
+void irsTxQueue(uint16_t ticks);
+
+/** @brief Queue the space that closes a frame, an extended edge when it is
+ * longer than one Timer0 period, used by the protocol synthesizer
  * 
- * @param[in] len - The number of bytes to copy
- * @param[out] buffer - Reference to the buffer to store the data
- * @return the number of bytes copied to the buffer
+ * @param[in] ticks - The length of the space in Timer0 ticks
  */
-unsigned char getUnsignedCharArrayUsbUart(uint8_t *buffer, uint8_t len);
+void irsTxQueueGap(uint32_t ticks);
+
+#ifdef ASM_TIMER_ISR
+/** @brief Timer0 Interrupt routine, clocks out the TX ring (assembly) */
+void timer0_interrupt(void) __interrupt(INT_NO_TMR0) __naked;
 
+/** @brief Timer1 Interrupt routine, soft PWM and RX flush timeout (assembly) */
+void timer1_interrupt(void) __interrupt(INT_NO_TMR1) __naked;
+#else
 /** @brief Timer0 Interrupt callback routine */
-inline void timer0_int_callback(void);  
+void timer0_int_callback(void) __using(TX_ISR_BANK);  
 
 /** @brief Timer1 Interrupt callback routine */
-inline void timer1_int_callback(void);  
+void timer1_int_callback(void) __using(T1_ISR_BANK);  
+#endif
 
 /** @brief Timer2 Interrupt callback routine */
-inline void timer2_int_callback(void);  
+void timer2_int_callback(void) __using(T1_ISR_BANK);  
 
-/** @brief This functions is used to configure a PWM-like output on
- *  one of the GPIO pins e.g Soft PWM
+/** @brief This functions is used to configure the carrier on the PWM pin,
+ *  with the selected backend, e.g Soft PWM or the PWM module
  * 
  * @param[in] freq - The desired pwm frequency in HZ
  * @param[out] timer1_pwm_val - This is the timer value that we set
  *  in order to make it interrupt and achieve the desired frequency on
- *  the PWM-like output pin
+ *  the PWM-like output pin (Soft PWM)
+ * @return the closest frequency the backend can make, in HZ
  */
-void PwmConfigure(uint16_t freq, uint16_t *timer1_pwm_val);
+uint16_t PwmConfigure(uint16_t freq, uint16_t *timer1_pwm_val);
 #endif
\ No newline at end of file
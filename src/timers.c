@@ -40,7 +40,7 @@ void ConfigTimer2(void) {
     T2MOD &= ~bT2_CAP_M1;   // M1 = 0
     T2MOD |= bT2_CAP_M0;    // M0 = 1 -> "Any Edge" mode
 }
-void RestartTimer1(void)
+void RestartTimer1(void) __using(T1_ISR_BANK)
 {
     TR1 = 0; //timer off
     TH1 = 0; //zero the TH1
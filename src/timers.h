@@ -13,6 +13,7 @@
 // ===================================================================================
 #pragma once
 #include <stdint.h>
+#include "config.h"
 // ===================================================================================
 // Definitions and Macros
 // ===================================================================================
@@ -21,6 +22,16 @@
 #define ENABLE_TIMER2() ET2=1;TR2=1;    // Enable Timer2
 #define DISABLE_TIMER2() TR2=0;ET2 = 0; // Disable Timer 2
 
+// Register banks of the timer interrupts, one per priority level, so that they
+// switch the bank instead of pushing R0-R7. Bank 0 is the main loop and the USB
+// and INT0 interrupts, the functions the timer interrupts call use the same bank.
+#ifdef TX_PRIO_HIGH
+#define TX_ISR_BANK   2     // Timer0, high priority
+#else
+#define TX_ISR_BANK   1     // Timer0, low priority
+#endif
+#define T1_ISR_BANK   1     // Timer1 and Timer2, low priority
+
 // ===================================================================================
 // Function declarations
 // ===================================================================================
@@ -45,4 +56,4 @@ void ConfigTimer2(void);
  *  to the USB host after approximately 2.7ms.
  *  The timer is restarted on each edge of the T2EX pin.
  */
-void RestartTimer1(void);
\ No newline at end of file
+void RestartTimer1(void) __using(T1_ISR_BANK);
\ No newline at end of file
@@ -24,6 +24,10 @@ volatile __xdata uint8_t CDC_readPointer   = 0;     // data pointer for fetching
 volatile __xdata uint8_t CDC_writePointer  = 0;     // data pointer for writing
 volatile __bit CDC_writeBusyFlag = 0;               // flag of whether upload pointer is busy
 
+// Source and destination of CDC_copy()
+static __xdata uint8_t * __data CDC_copySrc;
+static __xdata uint8_t * __data CDC_copyDst;
+
 // CDC class requests
 #define SET_LINE_CODING         0x20  // host configures line coding
 #define GET_LINE_CODING         0x21  // host reads configured line coding
@@ -92,6 +96,61 @@ void CDC_println(char* str) {
   CDC_write('\n');                                // write new line
   CDC_flush();                                    // flush OUT buffer
 }
+// Copy len (1..255) bytes from CDC_copySrc to CDC_copyDst, both in XRAM. Uses the
+// second data pointer, the same way as USB_EP0_copyDescr(), which runs in the USB
+// interrupt and does not save it, so the USB interrupt is held off meanwhile.
+// NO_DUAL_DPTR selects the plain C loop, for 8051 cores (and simulators) without it.
+#if defined(__SDCC) && !defined(NO_DUAL_DPTR)
+#pragma callee_saves CDC_copy
+static void CDC_copy(uint8_t len) {
+  len;                          // stop unreferenced argument warning
+  __asm
+    push acc                    ; acc -> stack
+    push ar7                    ; r7  -> stack
+    mov  r7, dpl                ; r7  <- len
+    mov  c, _IE_USB             ; hold off the USB interrupt,
+    clr  _IE_USB                ; the loop keeps the carry
+    inc  _XBUS_AUX              ; select dptr1
+    mov  dpl, _CDC_copyDst      ; dptr1 <- CDC_copyDst
+    mov  dph, (_CDC_copyDst + 1)
+    dec  _XBUS_AUX              ; select dptr0
+    mov  dpl, _CDC_copySrc      ; dptr0 <- CDC_copySrc
+    mov  dph, (_CDC_copySrc + 1)
+    01$:
+    movx a, @dptr               ; acc <- CDC_copySrc[dptr0]
+    inc  dptr                   ; inc dptr0
+    .db  0xA5                   ; acc -> CDC_copyDst[dptr1] & inc dptr1
+    djnz r7, 01$                ; repeat len times
+    mov  _IE_USB, c             ; USB interrupt back
+    pop  ar7                    ; r7  <- stack
+    pop  acc                    ; acc <- stack
+  __endasm;
+}
+#else
+static void CDC_copy(uint8_t len) {
+  do {
+    *CDC_copyDst++ = *CDC_copySrc++;
+  } while(--len);
+}
+#endif
+
+// Write len bytes to OUT buffer, it is flushed whenever it is full
+void CDC_writeBlock(__xdata uint8_t *buf, uint8_t len) {
+  uint8_t n;
+  while(len) {
+    while(CDC_writeBusyFlag);                     // wait for ready to write
+    n = EP2_SIZE - CDC_writePointer;
+    if(n > len) n = len;
+    CDC_copySrc = buf;
+    CDC_copyDst = inWhich() + CDC_writePointer;
+    CDC_copy(n);
+    buf += n;
+    len -= n;
+    CDC_writePointer += n;
+    if(CDC_writePointer == EP2_SIZE) CDC_flush(); // flush if buffer full
+  }
+}
+
 // Read single character from IN buffer
 char CDC_read_b(void) {
   char data;
@@ -9,6 +9,7 @@
 // CDC_ready()              check if OUT buffer is ready to be written
 // CDC_read()               read single character from IN buffer
 // CDC_write(c)             write single character to OUT buffer
+// CDC_writeBlock(buf, len) write len bytes to OUT buffer
 // CDC_writeflush(c)        write single character to OUT buffer and flush
 // CDC_print(s)             write string to OUT buffer
 // CDC_println(s)           write string with newline to OUT buffer and flush
@@ -40,6 +41,7 @@ void CDC_flush(void);             // flush OUT buffer
 char CDC_read(void);              // read single character from IN buffer
 char CDC_read_b(void);
 void CDC_write(char c);           // write single character to OUT buffer
+void CDC_writeBlock(__xdata uint8_t *buf, uint8_t len);     // write len bytes
 void CDC_print(char* str);        // write string to OUT buffer
 void CDC_println(char* str);      // write string with newline to OUT buffer and flush
 
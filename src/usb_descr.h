@@ -12,8 +12,9 @@
 // All string descriptors.
 //
 // In the makefile the following microcontroller settings must be made:
-// XRAM_LOC   = 0x0100
-// XRAM_SIZE  = 0x0300
+// XRAM_LOC   = 0x0114
+// XRAM_SIZE  = 0x00EC
+// (the XRAM from 0x0200 up is reserved for the IR transmit ring, see irs.h)
 
 #pragma once
 #include <stdint.h>
@@ -367,7 +367,7 @@ void USB_EP0_IN(void) {
       break;
 
     case USB_SET_ADDRESS:
-      USB_DEV_AD = USB_DEV_AD & bUDA_GP_BIT | USB_Addr;
+      USB_DEV_AD = (USB_DEV_AD & bUDA_GP_BIT) | USB_Addr;
       UEP0_CTRL  = bUEP_R_TOG | UEP_T_RES_NAK | UEP_R_RES_ACK;
       break;
 
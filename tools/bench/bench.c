@@ -0,0 +1,249 @@
+// ===================================================================================
+// Firmware benchmark for the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// Runs the hot paths of the firmware under the ucsim 8051 simulator (s51) and
+// prints the cycles of every call, one "bench,<name>,<cycles>" line each.
+//
+// The cycles are counted with the classic 8051 timers of the simulator, so they
+// are machine cycles (12 clocks) of a standard 8051. The CH552 core needs fewer
+// clocks for most instructions, so the numbers are for comparing firmware
+// revisions, not the absolute timing on the chip.
+//
+// irs.c is included, so that its static functions can be called directly.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+// Libraries, Definitions and Macros
+// ===================================================================================
+#define TX_KERNEL_REF   // keep txConvertC() next to the assembly kernel
+#include "src/irs.c"
+
+/** ucsim simulator interface, s51 is run with -I if=xram[0xffff] */
+#define SIF_PRINT   'p'
+#define SIF_STOP    's'
+__xdata __at (0xffff) volatile char sif;
+
+/** The CDC buffers, defined by main.c in the firmware */
+uint8_t * cdc_Out_buffer = (uint8_t *) EP2_buffer;
+uint8_t * cdc_In_buffer = (uint8_t *) EP2_buffer + 128;
+extern volatile __xdata uint8_t CDC_readPointer;
+
+static uint16_t benchOverhead;  // cycles of the timing code itself
+static __data uint8_t benchPsw;  // PSW of the caller, while a callback runs
+static __xdata uint8_t benchPacket[MAX_PACKET_SIZE];
+
+/** Time a statement with Timer0, Timer1 or Timer2 (16-bit, one count per
+ * machine cycle). The timer used must not be touched by the statement. */
+#define BENCH_T0(name, stmt) do { \
+    TR0 = 0; TH0 = 0; TL0 = 0; TR0 = 1; \
+    stmt; \
+    TR0 = 0; benchReport(name, ((uint16_t)TH0 << 8) | TL0); \
+} while (0)
+#define BENCH_T1(name, stmt) do { \
+    TR1 = 0; TH1 = 0; TL1 = 0; TR1 = 1; \
+    stmt; \
+    TR1 = 0; benchReport(name, ((uint16_t)TH1 << 8) | TL1); \
+} while (0)
+#define BENCH_T2(name, stmt) do { \
+    TR2 = 0; TH2 = 0; TL2 = 0; TR2 = 1; \
+    stmt; \
+    TR2 = 0; benchReport(name, ((uint16_t)TH2 << 8) | TL2); \
+} while (0)
+
+/** Run a timer callback in the register bank of its interrupt (see TX_ISR_BANK),
+ * PSW bits RS1 RS0 select the bank */
+#define BENCH_BANK(bank, stmt) do { \
+    benchPsw = PSW; PSW = (benchPsw & ~0x18) | ((bank) << 3); \
+    stmt; \
+    PSW = benchPsw; \
+} while (0)
+
+/** The Timer0 and Timer1 routines are in assembly (ASM_TIMER_ISR of irs.h), they
+ * are called directly, their RETI returns like a RET */
+#ifdef ASM_TIMER_ISR
+#define BENCH_TIMER0()  timer0_interrupt()
+#define BENCH_TIMER1()  timer1_interrupt()
+#else
+#define BENCH_TIMER0()  BENCH_BANK(TX_ISR_BANK, timer0_int_callback())
+#define BENCH_TIMER1()  BENCH_BANK(T1_ISR_BANK, timer1_int_callback())
+#endif
+
+// ===================================================================================
+// Function definitions
+// ===================================================================================
+
+static void benchPutc(char c){
+    sif = SIF_PRINT;
+    sif = c;
+}
+
+static void benchPuts(const char *s){
+    while (*s) benchPutc(*s++);
+}
+
+static void benchPutu(uint16_t v){
+    char d[5];
+    uint8_t i = 0;
+
+    do {
+        d[i++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (i) benchPutc(d[--i]);
+}
+
+/** @brief Fill the first EP2 OUT buffer with one packet of IRtoy samples */
+static void benchFillPacket(void){
+    uint8_t i;
+
+    for (i = 0; i < MAX_PACKET_SIZE; i += 2) {
+        EP2_buffer[i] = 0;
+        EP2_buffer[i + 1] = 0x20 + i;
+    }
+}
+
+#ifdef ASM_TX_KERNEL
+/** @brief Compare txKernel() with txConvertC() on every sample value and every
+ * txFrac, prints the number of mismatches (reload value, txFrac or the end flag) */
+static void benchKernelCheck(void){
+    uint16_t v = 0, bad = 0;
+    uint8_t f, h, l, frac;
+    __bit end;
+
+    do {
+        for (f = 0; f < TIMER_0_DEN; f++) {
+            EP2_buffer[0] = v >> 8;
+            EP2_buffer[1] = v;
+            txFrac = f;
+            txPacketEnd = 0;
+            txKernelBuf = EP2_buffer;
+            txKernelLen = 2;
+            txKernel();
+            h = EP2_buffer[0];
+            l = EP2_buffer[1];
+            if (!(h | l)) l = 1; // txConvertC() writes 0x0000 as 0x0001
+            frac = txFrac;
+            end = txPacketEnd;
+            EP2_buffer[0] = v >> 8;
+            EP2_buffer[1] = v;
+            txFrac = f;
+            txPacketEnd = 0;
+            txConvertC(EP2_buffer, 2, EP2_buffer);
+            if (h != EP2_buffer[0] || l != EP2_buffer[1] || frac != txFrac || end != txPacketEnd) {
+                bad++;
+            }
+        }
+    } while (++v);
+    benchPuts("bench,txKernel_mismatch,");
+    benchPutu(bad);
+    benchPutc('\n');
+}
+#endif
+
+/** @brief Print one result line, without the timing overhead */
+static void benchReport(const char *name, uint16_t cycles){
+    benchPuts("bench,");
+    benchPuts(name);
+    benchPutc(',');
+    benchPutu(cycles - benchOverhead);
+    benchPutc('\n');
+}
+
+void main(void) {
+    uint8_t i;
+
+    EA = 0;         // the callbacks are called directly
+    TMOD = 0x11;    // Timer0 and Timer1 16-bit
+    T2CON = 0;      // Timer2 16-bit auto reload, reload 0
+    RCAP2H = 0;
+    RCAP2L = 0;
+
+    TR0 = 0; TH0 = 0; TL0 = 0; TR0 = 1;
+    TR0 = 0;
+    benchOverhead = ((uint16_t)TH0 << 8) | TL0;
+
+    // TX conversion of one full EP2 OUT packet
+    txFrac = 0;
+    BENCH_T0("align_irtoy_ch552", align_irtoy_ch552(0x01, 0x23, EP2_buffer));
+    txPacketEnd = 0;
+#ifdef ASM_TX_KERNEL
+    benchFillPacket();
+    txKernelBuf = EP2_buffer;
+    txKernelLen = MAX_PACKET_SIZE;
+    BENCH_T0("txKernel_64", txKernel());
+#endif
+    benchFillPacket();
+    BENCH_T0("txConvertC_64", txConvertC(EP2_buffer, MAX_PACKET_SIZE, EP2_buffer));
+    txHead = 0;
+    txTail = 0;
+    txOdd = 0;
+    txLast = 0;
+    benchFillPacket();
+    BENCH_T0("txConvert_64", txConvert(EP2_buffer, MAX_PACKET_SIZE, NULL));
+    benchFillPacket();
+    BENCH_T0("txConvert_64_stage", txConvert(EP2_buffer, MAX_PACKET_SIZE, txStage));
+    benchFillPacket();
+    BENCH_T0("txConvertTicks_64", txConvertTicks(EP2_buffer, MAX_PACKET_SIZE, NULL));
+    txHead = 0;
+    txTail = 0;
+    txStageLen = MAX_PACKET_SIZE;
+    BENCH_T0("txStageFlush_64", txStageFlush());
+
+    // TX engine, the next edge and the end of the frame. PWMon/off use Timer1
+    txBusy = 1;
+    txInvert = IRS_TRANSMIT_LO;
+    txLoops = 0;
+    txGapLeft = 0;
+    BENCH_T2("timer0_int_callback", BENCH_TIMER0());
+    txTail = txHead;
+    txEnd = txHead;
+    BENCH_T2("timer0_int_callback_end", BENCH_TIMER0());
+
+    // Soft PWM carrier toggle and the RX flush timeout
+    txBusy = 1;
+    TR1 = 1;        // the carrier is on, Timer1 runs
+    BENCH_T0("timer1_int_callback", BENCH_TIMER1());
+    txBusy = 0;
+    BENCH_T0("timer1_int_callback_timeout", BENCH_TIMER1());
+
+    // RX capture, an edge, a Timer2 overflow and an edge after a gap
+    irS.t2_count = 0;
+    RCAP2H = 0x12;
+    RCAP2L = 0x34;
+    TF2 = 0;
+    EXF2 = 1;
+    BENCH_T0("timer2_int_callback", BENCH_BANK(T1_ISR_BANK, timer2_int_callback()));
+    TF2 = 1;
+    EXF2 = 0;
+    BENCH_T0("timer2_int_callback_overflow", BENCH_BANK(T1_ISR_BANK, timer2_int_callback()));
+    irS.t2_count = 3;
+    TF2 = 0;
+    EXF2 = 1;
+    BENCH_T0("timer2_int_callback_gap", BENCH_BANK(T1_ISR_BANK, timer2_int_callback()));
+    BENCH_T0("scale_gap_irtoy", scale_gap_irtoy(3, 0x1234));
+    rxFrac = 0;
+    BENCH_T0("scale_ch552_irtoy", scale_ch552_irtoy(0x1234));
+
+    // CDC, the USB is not simulated, so the busy flag is cleared by hand
+    CDC_writeBusyFlag = 0;
+    CDC_writePointer = 0;
+    BENCH_T0("CDC_write", CDC_write('x'));
+    BENCH_T0("CDC_flush", CDC_flush());
+    CDC_writeBusyFlag = 0;
+    CDC_readByteCount = 2;
+    CDC_readPointer = 0;
+    BENCH_T0("CDC_read_b", CDC_read_b());
+    // One full packet
+    CDC_writeBusyFlag = 0;
+    CDC_writePointer = 0;
+    BENCH_T0("CDC_writeBlock", CDC_writeBlock(benchPacket, MAX_PACKET_SIZE));
+
+#ifdef ASM_TX_KERNEL
+    // Last, as it takes a while
+    benchKernelCheck();
+#endif
+
+    sif = SIF_STOP;
+    while (1);
+}
@@ -0,0 +1,113 @@
+// ===================================================================================
+// Exhaustive check of the TX and RX unit conversions of the firmware.
+// ===================================================================================
+// Runs the C conversions of irs.c on the host against plain integer references,
+// for every 16-bit value and every state of the carried remainder:
+//   tx   txConvertC(), reload = -((128 * v + txFrac) / 3), txFrac' = the remainder
+//   rx   scale_ch552_irtoy(), units = (3 * ticks + rxFrac) / 128, rxFrac' = the remainder
+//   gap  scale_gap_irtoy(), units = 3 * (periods * 65536 + ticks) / 128, up to 0xFFFE
+// Prints one "conv,<name>,<values checked>" line per conversion and exits with 1
+// at the first mismatch, after printing it.
+//
+// irs.c is included, so that its static functions can be called directly. The
+// firmware loops do not need the virtual time here, so the loop macros of sim_fw.h
+// are taken back.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+// Libraries, Definitions and Macros
+// ===================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim_fw.h"
+#undef while
+#undef for
+#include "src/irs.c"
+
+// ===================================================================================
+// Function definitions
+// ===================================================================================
+
+static void convFail(const char *name, uint32_t value, uint32_t state, uint32_t got, uint32_t want){
+    printf("conv,%s,mismatch at 0x%lx state %lu: 0x%lx, expected 0x%lx\n", name,
+           (unsigned long)value, (unsigned long)state, (unsigned long)got, (unsigned long)want);
+    exit(1);
+}
+
+/** @brief txConvertC() into a stage buffer, one sample at a time */
+static void convCheckTx(void){
+    static __xdata uint8_t out[2];
+    uint8_t buf[2], f, n;
+    uint32_t v, total, checked = 0;
+    uint16_t reload;
+
+    for (v = 0; v <= 0xFFFF; v++) {
+        for (f = 0; f < TIMER_0_DEN; f++) {
+            buf[0] = v >> 8;
+            buf[1] = v;
+            txFrac = f;
+            txPacketEnd = 0;
+            n = txConvertC(buf, 2, out);
+            if (v == 0) {
+                // the extended edge escape, nothing is converted
+                if (n != 0 || txFrac != f) convFail("tx", v, f, n, 0);
+                continue;
+            }
+            if (n != 2 || txPacketEnd != (v == 0xFFFF)) convFail("tx", v, f, n, 2);
+            // the end of data marker is sent as 40 units (0x2800)
+            total = TIMER_0_NUM * (v == 0xFFFF ? 0x2800 : v) + f;
+            reload = -(uint16_t)(total / TIMER_0_DEN);
+            if (reload == 0) reload = 1;            // as txRingPut() does
+            if (((out[0] << 8) | out[1]) != reload) {
+                convFail("tx", v, f, (out[0] << 8) | out[1], reload);
+            }
+            if (txFrac != total % TIMER_0_DEN) convFail("tx_frac", v, f, txFrac, total % TIMER_0_DEN);
+            checked++;
+        }
+    }
+    printf("conv,tx,%lu\n", (unsigned long)checked);
+}
+
+static void convCheckRx(void){
+    uint32_t ticks, total, checked = 0;
+    uint16_t units;
+    uint8_t f;
+
+    for (ticks = 0; ticks <= 0xFFFF; ticks++) {
+        for (f = 0; f < TIMER_0_NUM; f++) {
+            rxFrac = f;
+            units = scale_ch552_irtoy(ticks);
+            total = TIMER_0_DEN * ticks + f;
+            if (units != total / TIMER_0_NUM) convFail("rx", ticks, f, units, total / TIMER_0_NUM);
+            if (rxFrac != total % TIMER_0_NUM) convFail("rx_frac", ticks, f, rxFrac, total % TIMER_0_NUM);
+            checked++;
+        }
+    }
+    printf("conv,rx,%lu\n", (unsigned long)checked);
+}
+
+static void convCheckGap(void){
+    uint32_t ticks, want, checked = 0;
+    uint16_t units;
+    uint16_t periods;
+
+    for (periods = 0; periods <= 0xFF; periods++) {
+        for (ticks = 0; ticks <= 0xFFFF; ticks++) {
+            rxFrac = 0x55;                          // a gap does not carry it
+            units = scale_gap_irtoy(periods, ticks);
+            want = (uint64_t)TIMER_0_DEN * (((uint32_t)periods << 16) + ticks) / TIMER_0_NUM;
+            if (want > 0xFFFE) want = 0xFFFE;
+            if (units != want) convFail("gap", ((uint32_t)periods << 16) + ticks, 0, units, want);
+            checked++;
+        }
+    }
+    printf("conv,gap,%lu\n", (unsigned long)checked);
+}
+
+int main(void){
+    convCheckTx();
+    convCheckRx();
+    convCheckGap();
+    return 0;
+}
@@ -0,0 +1,36 @@
+# ===================================================================================
+# Prepares a firmware source file for the host build of the simulator.
+# ===================================================================================
+# - __asm ... __endasm blocks are dropped (__asm__("...") is defined away by sim_fw.h)
+# - the SFR, SFR16, SFRX and SBIT declarations become macros into the register
+#   model of sim.c, so TR0 = 1 is a write to simSfr[0x88].b4
+# The line numbers are kept, so the compiler messages point to the original source.
+# ===================================================================================
+
+/__asm/ && !/__asm__/ { skip = 1 }
+skip {
+    if (/__endasm/) skip = 0
+    print ""
+    next
+}
+
+/^[ \t]*(SBIT|SFR|SFR16|SFRX)\(/ {
+    line = $0
+    sub(/^[ \t]*/, "", line)
+    kind = substr(line, 1, index(line, "(") - 1)
+    args = substr(line, index(line, "(") + 1)
+    args = substr(args, 1, index(args, ")") - 1)
+    n = split(args, a, ",")
+    for (i = 1; i <= n; i++) gsub(/[ \t]/, "", a[i])
+    if (kind == "SBIT")
+        print "#define " a[1] " simSfr[" a[2] "].b" a[3]
+    else if (kind == "SFR")
+        print "#define " a[1] " simSfr[" a[2] "].b"
+    else if (kind == "SFR16")
+        print "#define " a[1] " SIM_SFR16(" a[2] ")"
+    else
+        print "#define " a[1] " simXsfr[" a[2] "]"
+    next
+}
+
+{ print }
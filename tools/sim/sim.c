@@ -0,0 +1,415 @@
+// ===================================================================================
+// Host simulator of the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// Models the parts of the CH552 the firmware uses, in virtual time counted in Fsys
+// clocks:
+// - Timer0, Timer1 (mode 1) and Timer2 (capture mode) with their clock dividers
+// - INT0 (falling edge) and the T2EX capture, both wired to the IR receiver
+// - the interrupts with their enable and priority bits, one level can interrupt
+//   the other, the flags the hardware clears on entry are cleared, the worst time
+//   from a timer overflow to its service routine is kept (simIrqLatency)
+// - the IR LED envelope (the soft PWM Timer1 or the PWM2 module) and the soft PWM pin
+// - the EP2 double buffers and the USB host, one bulk transaction per simCost.usbSlot,
+//   the endpoint is busy (NAK) while UIF_TRANSFER is set
+// - the IR library in the code flash, as a host array
+// The USB enumeration (EP0) is not simulated, the device starts configured.
+//
+// The firmware runs unchanged, main.c, irs.c, usb_cdc.c and usb_handler.c are built
+// for the host with the macros of sim_fw.h, see the Makefile.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+// Libraries, Definitions and Macros
+// ===================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "ch554.h"
+#include "usb_descr.h"
+#include "irlib.h"
+
+#define SIM_OUT_PACKETS 1024    // EP2 OUT packets the host can queue
+#define SIM_IR_EDGES    8192    // IR receiver changes that can be scheduled
+
+volatile SIM_SFR simSfr[256];
+volatile uint8_t simXsfr[0x10000];
+
+// estimates, until the bench gives the numbers, see SIM_COST
+SIM_COST simCost = {
+    .loop    = 60,
+    .entry   = 140,                     // SPWM_DRIFT of config.h is about that
+    .isr     = {
+        [SIM_IRQ_INT0] = 40,
+        [SIM_IRQ_TMR0] = 100,
+        [SIM_IRQ_TMR1] = 60,
+        [SIM_IRQ_TMR2] = 300,
+        [SIM_IRQ_USB]  = 200,
+    },
+    .usbSlot = 60 * (SIM_FSYS / 1000000),
+};
+sim_time_t simNow;
+sim_time_t simLimit = ~(sim_time_t)0;
+uint32_t simPwmToggles;
+sim_time_t simIrqLatency[SIM_IRQS];
+bool simFlatPrio;
+
+void (*simOnRead)(const uint8_t *buf, uint8_t len);
+void (*simOnCarrier)(bool on);
+void (*simOnLimit)(void);
+
+/** Timer count registers and the T2MOD bit of the faster clock */
+static volatile uint8_t *const timerTH[3] = {&TH0, &TH1, &TH2};
+static volatile uint8_t *const timerTL[3] = {&TL0, &TL1, &TL2};
+static const uint8_t timerFast[3] = {bT0_CLK, bT1_CLK, bT2_CLK};
+static uint32_t timerPhase[3];          // clocks counted towards the next timer tick
+static sim_time_t timerFlagAt[3];       // time of the last overflow
+
+static struct {
+    sim_time_t at;                      // the host sends it from that time on
+    uint8_t len;
+    uint8_t data[EP2_SIZE];
+} outQueue[SIM_OUT_PACKETS];
+static uint16_t outHead, outTail;
+static sim_time_t usbNext;              // time of the next bulk transaction
+static bool usbRaised;                  // UIF_TRANSFER was raised by the model
+
+static struct {
+    sim_time_t at;
+    bool level;
+} irEdges[SIM_IR_EDGES];
+static uint16_t irHead, irTail;
+static bool irLevel = 1;                // IR receiver output, idle high
+
+static int8_t level = -1;               // priority of the running interrupt, -1 in main
+static bool carrier;                    // IR LED envelope
+static bool pwmPin;                     // soft PWM pin
+
+/** The USB descriptors of usb_descr.c, the enumeration is not simulated (and gcc
+ * does not take the string descriptors there, they use their own size) */
+USB_DEV_DESCR DevDescr;
+USB_CFG_DESCR_CDC CfgDescr;
+uint16_t LangDescr[1], ManufDescr[1], ProdDescr[1], SerDescr[1], InterfDescr[1];
+
+static uint16_t flash[IRLIB_SLOTS * IRLIB_SLOT_SIZE / 2];
+static uint16_t flashAddr, flashEnd;
+
+static void simSpend(sim_time_t clocks);
+
+// ===================================================================================
+// Timers
+// ===================================================================================
+
+static uint8_t timerDiv(uint8_t n){
+    if (!(T2MOD & timerFast[n])) return 12;
+    return (T2MOD & bTMR_CLK) ? 1 : 4;
+}
+
+static bool timerRuns(uint8_t n){
+    switch (n) {
+        case 0: return TR0 && (!(TMOD & bT0_GATE) || irLevel);
+        case 1: return TR1 && !(TMOD & bT1_GATE);
+        default: return TR2 && !C_T2;
+    }
+}
+
+static uint16_t timerCount(uint8_t n){
+    return ((uint16_t)*timerTH[n] << 8) | *timerTL[n];
+}
+
+/** @brief Clocks until the timer overflows, 0 if it is stopped */
+static sim_time_t timerDue(uint8_t n){
+    if (!timerRuns(n)) return 0;
+    return (sim_time_t)(0x10000 - timerCount(n)) * timerDiv(n) - timerPhase[n];
+}
+
+static void timerAdvance(uint8_t n, sim_time_t clocks){
+    sim_time_t total, count;
+    uint8_t div;
+
+    if (!timerRuns(n)) return;
+    div = timerDiv(n);
+    total = timerPhase[n] + clocks;
+    timerPhase[n] = total % div;
+    count = timerCount(n) + total / div;
+    if (count > 0xFFFF) {
+        timerFlagAt[n] = simNow + clocks;
+        switch (n) {
+            case 0: TF0 = 1; break;
+            case 1: TF1 = 1; break;
+            default: TF2 = 1; break;
+        }
+    }
+    *timerTH[n] = count >> 8;
+    *timerTL[n] = count;
+}
+
+// ===================================================================================
+// Interrupts
+// ===================================================================================
+
+/** @brief Keep only the USB flags the model raised, the firmware clears the
+ * others by writing ones */
+static void usbFlags(void){
+    if (usbRaised && !UIF_TRANSFER) usbRaised = 0;
+    if (!usbRaised) USB_INT_FG = 0;
+}
+
+static bool irqPending(uint8_t irq){
+    switch (irq) {
+        case SIM_IRQ_INT0: return EX0 && IE0;
+        case SIM_IRQ_TMR0: return ET0 && TF0;
+        case SIM_IRQ_TMR1: return ET1 && TF1;
+        case SIM_IRQ_TMR2: return ET2 && (TF2 || EXF2);
+        default:           usbFlags(); return IE_USB && UIF_TRANSFER;
+    }
+}
+
+static int8_t irqPriority(uint8_t irq){
+    if (simFlatPrio) return 0;
+    switch (irq) {
+        case SIM_IRQ_INT0: return PX0;
+        case SIM_IRQ_TMR0: return PT0;
+        case SIM_IRQ_TMR1: return PT1;
+        case SIM_IRQ_TMR2: return PT2;
+        default:           return (IP_EX & bIP_USB) ? 1 : 0;
+    }
+}
+
+/** @brief The flags the hardware clears when it takes the vector */
+static void irqEnter(uint8_t irq){
+    switch (irq) {
+        case SIM_IRQ_INT0: if (IT0) IE0 = 0; break;
+        case SIM_IRQ_TMR0: TF0 = 0; break;
+        case SIM_IRQ_TMR1: TF1 = 0; break;
+        default:           break;
+    }
+}
+
+static void irqCall(uint8_t irq){
+    switch (irq) {
+        case SIM_IRQ_INT0: ext0_interrupt(); break;
+        case SIM_IRQ_TMR0: timer0_interrupt(); break;
+        case SIM_IRQ_TMR1: timer1_interrupt(); break;
+        case SIM_IRQ_TMR2: Timer2_ISR(); break;
+        default:           USB_ISR(); break;
+    }
+}
+
+/** @brief Look at the outputs, the IR LED envelope and the soft PWM pin */
+static void simObserve(void){
+    bool on = (TR1 && ET1) || (PWM_CTRL & bPWM2_OUT_EN);
+    bool pin = (P3 >> 4) & 1;
+
+    if (pin != pwmPin) {
+        pwmPin = pin;
+        simPwmToggles++;
+    }
+    if (on != carrier) {
+        carrier = on;
+        if (simOnCarrier) simOnCarrier(on);
+    }
+}
+
+/** @brief Run the pending interrupts above the current priority level, the
+ * lowest vector first within a level */
+static void simDispatch(void){
+    int8_t saved, best, prio;
+    uint8_t irq;
+
+    while (EA) {
+        best = -1;
+        for (irq = 0; irq < SIM_IRQS; irq++) {
+            prio = irqPriority(irq);
+            if (prio > level && irqPending(irq) && (best < 0 || prio > irqPriority(best))) {
+                best = irq;
+            }
+        }
+        if (best < 0) return;
+        saved = level;
+        level = irqPriority(best);
+        irqEnter(best);
+        simSpend(simCost.entry);        // vector, register saves and the call
+        if (best >= SIM_IRQ_TMR0 && best <= SIM_IRQ_TMR2 &&
+            simNow - timerFlagAt[best - SIM_IRQ_TMR0] > simIrqLatency[best]) {
+            simIrqLatency[best] = simNow - timerFlagAt[best - SIM_IRQ_TMR0];
+        }
+        irqCall(best);
+        simObserve();
+        simSpend(simCost.isr[best]);
+        level = saved;
+    }
+}
+
+// ===================================================================================
+// USB host and IR receiver
+// ===================================================================================
+
+static void usbRaise(uint8_t token, bool togOk){
+    USB_INT_ST = token | 2;             // EP2
+    USB_INT_FG = 0;
+    UIF_TRANSFER = 1;
+    U_TOG_OK = togOk;
+    usbRaised = 1;
+}
+
+/** @brief One bulk transaction on EP2, an IN when the device has data ready,
+ * else an OUT when the host has data queued and the device takes it */
+static void usbTransaction(void){
+    uint8_t *buf;
+
+    usbFlags();
+    if (!(UDEV_CTRL & bUD_PORT_EN)) return;                 // not connected yet
+    if ((USB_CTRL & bUC_INT_BUSY) && UIF_TRANSFER) return;  // NAK
+    if ((UEP2_CTRL & MASK_UEP_T_RES) == UEP_T_RES_ACK) {
+        buf = &EP2_buffer[(UEP2_CTRL & bUEP_T_TOG) ? 192 : 128];
+        if (simOnRead) simOnRead(buf, UEP2_T_LEN);
+        UEP2_CTRL ^= bUEP_T_TOG;
+        usbRaise(UIS_TOKEN_IN, 1);
+    } else if (outHead != outTail && simNow >= outQueue[outTail].at &&
+               (UEP2_CTRL & MASK_UEP_R_RES) == UEP_R_RES_ACK) {
+        buf = &EP2_buffer[(UEP2_CTRL & bUEP_R_TOG) ? 64 : 0];
+        memcpy(buf, outQueue[outTail].data, outQueue[outTail].len);
+        USB_RX_LEN = outQueue[outTail].len;
+        outTail = (outTail + 1) % SIM_OUT_PACKETS;
+        UEP2_CTRL ^= bUEP_R_TOG;
+        usbRaise(UIS_TOKEN_OUT, 1);
+    }
+}
+
+void simHostWrite(const uint8_t *buf, uint16_t len){
+    uint8_t n;
+
+    while (len) {
+        n = len > EP2_SIZE ? EP2_SIZE : len;
+        if ((outHead + 1) % SIM_OUT_PACKETS == outTail) {
+            fprintf(stderr, "sim: host OUT queue full\n");
+            exit(2);
+        }
+        outQueue[outHead].at = simNow + simCost.hostTurn;
+        memcpy(outQueue[outHead].data, buf, n);
+        outQueue[outHead].len = n;
+        outHead = (outHead + 1) % SIM_OUT_PACKETS;
+        buf += n;
+        len -= n;
+    }
+}
+
+void simIrEdge(sim_time_t at, bool level){
+    if ((irHead + 1) % SIM_IR_EDGES == irTail) {
+        fprintf(stderr, "sim: IR edge queue full\n");
+        exit(2);
+    }
+    irEdges[irHead].at = at;
+    irEdges[irHead].level = level;
+    irHead = (irHead + 1) % SIM_IR_EDGES;
+}
+
+/** @brief Apply a change of the IR receiver output to INT0 and T2EX */
+static void irApply(bool level){
+    if (level == irLevel) return;
+    irLevel = level;
+    P3 = (P3 & ~0x04) | (level << 2);   // P3.2 INT0
+    P1 = (P1 & ~0x02) | (level << 1);   // P1.1 T2EX
+    if (!level || !IT0) IE0 = 1;        // falling edge (or low level)
+    if (EXEN2 && CP_RL2) {              // capture on any edge
+        RCAP2L = TL2;
+        RCAP2H = TH2;
+        EXF2 = 1;
+    }
+}
+
+uint32_t simHwCarrier(void){
+    if (!(PWM_CTRL & bPWM2_OUT_EN) || !PWM_CK_SE) return 0;
+    return SIM_FSYS / 256 / PWM_CK_SE;
+}
+
+// ===================================================================================
+// Virtual time
+// ===================================================================================
+
+/** @brief Time of the next event: a timer overflow, an IR edge or a USB slot */
+static sim_time_t simNext(void){
+    sim_time_t next = usbNext, due;
+    uint8_t n;
+
+    for (n = 0; n < 3; n++) {
+        due = timerDue(n);
+        if (due && simNow + due < next) next = simNow + due;
+    }
+    if (irHead != irTail && irEdges[irTail].at < next) next = irEdges[irTail].at;
+    return next < simNow ? simNow : next;
+}
+
+/** @brief Let the given CPU time pass at the current priority level. The
+ * events on the way are applied and the interrupts above the level are run,
+ * their time is added, as the CPU is taken away meanwhile. */
+static void simSpend(sim_time_t clocks){
+    sim_time_t step;
+    uint8_t n;
+
+    for (;;) {
+        step = simNext() - simNow;
+        if (step > clocks) step = clocks;
+        for (n = 0; n < 3; n++) timerAdvance(n, step);
+        simNow += step;
+        clocks -= step;
+        // the touch-key timer flag of DLY_ms(), set every other half millisecond
+        TKEY_CTRL = (TKEY_CTRL & ~bTKC_IF) | ((simNow / SIM_US(500)) & 1 ? bTKC_IF : 0);
+        while (irHead != irTail && irEdges[irTail].at <= simNow) {
+            irApply(irEdges[irTail].level);
+            irTail = (irTail + 1) % SIM_IR_EDGES;
+        }
+        if (usbNext <= simNow) {
+            usbTransaction();
+            usbNext = simNow + simCost.usbSlot;
+        }
+        simDispatch();
+        if (!clocks) break;
+    }
+    if (simNow >= simLimit && simOnLimit) simOnLimit();
+}
+
+void simYield(void){
+    simObserve();
+    simSpend(simCost.loop);
+}
+
+void simStart(void){
+    usbNext = simCost.usbSlot;
+    P1 = 0xFF;                          // port latches after reset
+    P3 = 0xFF;
+    pwmPin = 1;
+    memset(flash, 0xFF, sizeof(flash)); // erased code flash
+    fw_main();
+}
+
+// ===================================================================================
+// IR library in the code flash, see irlib.c
+// ===================================================================================
+
+__code IRLIB_SLOT *irlibGet(uint8_t slot){
+    IRLIB_SLOT *s;
+
+    if (slot >= IRLIB_SLOTS) return NULL;
+    s = (IRLIB_SLOT *)&flash[slot * IRLIB_SLOT_SIZE / 2];
+    if (s->edges == 0 || s->edges > IRLIB_SLOT_EDGES) return NULL;
+    return s;
+}
+
+bool irlibOpen(uint8_t slot){
+    if (slot >= IRLIB_SLOTS) return false;
+    flashAddr = slot * IRLIB_SLOT_SIZE / 2;
+    flashEnd = flashAddr + IRLIB_SLOT_SIZE / 2;
+    return true;
+}
+
+bool irlibWrite(uint16_t word){
+    if (flashAddr >= flashEnd) return false;
+    flash[flashAddr++] = word;
+    return true;
+}
+
+void irlibClose(void){
+}
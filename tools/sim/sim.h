@@ -0,0 +1,121 @@
+// ===================================================================================
+// Host simulator of the Irdroid USB Infrared Transceiver v3 firmware.
+// ===================================================================================
+// Register model, virtual time and the host side (USB host and IR receiver) of the
+// simulator, shared by sim.c, the scenarios in simrun.c and, through sim_fw.h, by
+// the firmware sources.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// ===================================================================================
+// SDCC extensions, the firmware data is plain host memory
+// ===================================================================================
+#define __xdata
+#define __pdata
+#define __data
+#define __idata
+#define __code
+#define __at(x)
+#define __bit           bool
+#define __interrupt(x)
+#define __using(x)
+#define __critical
+#define __naked
+#define __reentrant
+
+// ===================================================================================
+// Definitions and Macros
+// ===================================================================================
+#define SIM_FSYS        24000000UL
+#define SIM_US(us)      ((sim_time_t)(us) * (SIM_FSYS / 1000000))   // us to clocks
+#define SIM_TO_US(t)    ((double)(t) / (SIM_FSYS / 1000000))        // clocks to us
+
+/** Virtual time in Fsys clocks */
+typedef uint64_t sim_time_t;
+
+/** One special function register, as a byte and as its eight bits */
+typedef union {
+    uint8_t b;
+    struct {
+        uint8_t b0 : 1, b1 : 1, b2 : 1, b3 : 1, b4 : 1, b5 : 1, b6 : 1, b7 : 1;
+    };
+} SIM_SFR;
+
+/** The SFR and xSFR spaces, the firmware reaches them through the ch554.h macros */
+extern volatile SIM_SFR simSfr[256];
+extern volatile uint8_t simXsfr[0x10000];
+#define SIM_SFR16(addr) (*(volatile uint16_t *)&simSfr[addr].b)   // little-endian pair
+
+/** Interrupt sources, in the order of their vectors */
+enum {
+    SIM_IRQ_INT0,
+    SIM_IRQ_TMR0,
+    SIM_IRQ_TMR1,
+    SIM_IRQ_TMR2,
+    SIM_IRQ_USB,
+    SIM_IRQS
+};
+
+/** CPU time charged to the firmware, in Fsys clocks. Take the numbers from the
+ * benchmark (make bench) when they are available. */
+typedef struct {
+    uint32_t loop;              // one pass of a firmware loop (main loop, copy loops)
+    uint32_t entry;             // from the interrupt flag to the service routine body
+    uint32_t isr[SIM_IRQS];     // the service routines, up to and with the RETI
+    uint32_t usbSlot;           // period of the USB bulk transactions of the host
+    uint32_t hostTurn;          // from simHostWrite() to the first OUT of the data
+} SIM_COST;
+
+extern SIM_COST simCost;
+extern sim_time_t simNow;       // current virtual time
+extern sim_time_t simLimit;     // simOnLimit() is called when the time gets there
+extern uint32_t simPwmToggles;  // soft PWM pin toggles, for the carrier frequency
+extern sim_time_t simIrqLatency[SIM_IRQS];  // worst time from a timer overflow to its routine
+extern bool simFlatPrio;        // ignore IP and IP_EX, all interrupts on one level
+
+/** Scenario callbacks, all optional */
+extern void (*simOnRead)(const uint8_t *buf, uint8_t len);  // IN packet at the host
+extern void (*simOnCarrier)(bool on);                       // IR LED envelope changed
+extern void (*simOnLimit)(void);                            // simLimit is reached
+
+// ===================================================================================
+// Function declarations
+// ===================================================================================
+
+/** @brief Reset the model and run the firmware, never returns. The scenario
+ * ends the process from one of its callbacks. */
+void simStart(void);
+
+/** @brief Charge one pass of a firmware loop, called by the loop macros of sim_fw.h */
+void simYield(void);
+
+/** @brief Queue bytes for the device, they go out as 64 byte EP2 OUT packets
+ *
+ * @param[in] buf - The data
+ * @param[in] len - The number of bytes
+ */
+void simHostWrite(const uint8_t *buf, uint16_t len);
+
+/** @brief Schedule a change of the IR receiver output (INT0 and T2EX pins),
+ * the receiver pulls the line low during a mark
+ *
+ * @param[in] at - The time of the change, not before the last scheduled one
+ * @param[in] level - The new pin level
+ */
+void simIrEdge(sim_time_t at, bool level);
+
+/** @brief The frequency of the hardware PWM carrier, 0 while it is off */
+uint32_t simHwCarrier(void);
+
+// The firmware entry points (main.c is built with main renamed to fw_main)
+void fw_main(void);
+void ext0_interrupt(void);
+void timer0_interrupt(void);
+void timer1_interrupt(void);
+void Timer2_ISR(void);
+void USB_ISR(void);
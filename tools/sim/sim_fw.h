@@ -0,0 +1,27 @@
+// ===================================================================================
+// Forced include of the firmware sources in the host build of the simulator.
+// ===================================================================================
+// Every pass of a while or for loop charges simCost.loop clocks of virtual time
+// and lets the simulator run the timers, the interrupts and the USB host, this is
+// how the busy waits of the firmware (e.g. WaitInReady()) see the hardware move.
+//
+// Note that int is 32 bits wide here and 16 bits on the device.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "sim.h"
+
+#define __asm__(x)
+#define register
+
+/** SDCC runtime, 16-bit unsigned division */
+#define _divuint(a, b)  ((uint16_t)((uint16_t)(a) / (uint16_t)(b)))
+
+#define while(c)        while (simYield(), (c))
+#define for(...)        for (__VA_ARGS__) if (simYield(), 0) {} else
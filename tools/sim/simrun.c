@@ -0,0 +1,1095 @@
+// ===================================================================================
+// Scenarios of the firmware simulator, see sim.c
+// ===================================================================================
+// Usage: irsim [options] tx|rx|txrate|rxrate|replay|proto|decode|lib|repeat|info
+//
+//   tx      the host sends one IRtoy frame of -n edges of -e us each (0x25, 0x03),
+//           reports the result (C or F), the latency from the host to the first
+//           carrier edge, the timing error of the IR LED envelope and the worst
+//           time from a Timer0 overflow to its interrupt routine
+//   rx      the IR receiver sees -n edges of -e us each, reports the values the
+//           host got, the lost ones, the error and the latency to the host
+//   txrate  the shortest edge the TX path keeps up with, the frame completes and
+//           every edge is within -t us
+//   rxrate  the shortest edge the RX path keeps up with, no edge is lost and
+//           every value is within -t us
+//   replay  a long frame of air conditioner edges (3000/1500 us headers, 450 us marks,
+//           450 or 1300 us spaces, 10 ms section gaps, 1001 edges unless -n is given)
+//           goes through the TX path in IRtoy units and in ticks, and through the
+//           RX path, reports the worst cumulative error from the first edge: TX in
+//           IRtoy units against the same frame in the ticks the units convert to,
+//           as both see the same interrupt latency, RX against the exact edges
+//           (-k selects the RX values only); fails when one is above -t us or a
+//           run fails
+//   proto   the host sends NEC, Samsung, RC5, RC6 and Sony codes with one repeat
+//           each (0x25, 0x50), one after the other, the IR LED envelope is checked
+//           against the protocol timings, the period and the NEC repeat code, the
+//           RC5/RC6 toggle flips per code; fails when a code is not answered C,
+//           an edge is missing or off by more than -t us or the carrier is off
+//           by more than 3 %
+//   decode  the IR receiver sees the same codes in the decoding receive mode (0x51 1),
+//           each one three times: the frame, the frame (NEC: the repeat code) one
+//           period later and the frame 250 ms later, the RC5/RC6 toggle flipped;
+//           fails when a record (D) is missing or wrong, the second one of each
+//           code has the repeat flag, the others do not
+//   lib     the host sends -n edges of the replay frame (0x25, 0x03), stores the
+//           frame in a library slot (0x52), plays an empty slot and then the
+//           stored one (0x80 | slot), reports the replay as tx does; fails when
+//           the store is not answered C, the empty slot not F or the replay is
+//           not as tx would pass it
+//   repeat  the host sends one frame as tx does and IRIO_TX_REPEAT (0x53) of 2
+//           copies and a 20 ms gap right behind it, then once more after the C,
+//           which sends the frame again; fails when the first C does not come
+//           after the 3 copies, the last repeat is not answered C of its own, a
+//           gap or an edge is off by more than -t us
+//   info    the host sends 'I' in the main mode, reports the device information
+//
+// Options:
+//   -e us          edge length, default 500
+//   -n edges       number of edges, odd, default 101
+//   -t us          error tolerance of a pass, default 50
+//   -u us          period of the USB bulk transactions, default 60
+//   -l us          turnaround of the host software, from an IN to its answer, default 0
+//   -f flow        flow control of tx, 0 none (default), 1 handshake, 2 credits
+//   -d             tx sends the frame as IRIO_TRANSMIT_DICT, one packet
+//   -x             tx sends every edge as an extended edge, 0x0000 [periods] [ticks]
+//   -k             durations in 0.5 us ticks (IRIO_UNITS) instead of IRtoy units
+//   -r mode        receive mode (IRIO_RX_MODE) of rx, 0 raw (default) or 3 compact
+//   -c name=clk    CPU clocks of loop, entry, int0, t0, t1, t2 or usb
+//   -p             all interrupts on one priority level, the firmware map is ignored
+//   -q             no report, only the exit code (0 pass, 1 fail)
+//
+// The report is one "scenario,key,value" line per result, the rate scenarios run
+// every try in a child process, as the firmware state is not reset otherwise.
+//
+// Author: Georgi Bakalski JAN 2026
+//
+// ===================================================================================
+// Libraries, Definitions and Macros
+// ===================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "sim.h"
+
+#define NOTIFY_COMPLETE 0x25            // IRIO_NOTIFYONCOMPLETE of irs.h
+#define TRANSMIT        0x03            // IRIO_TRANSMIT_unit of irs.h
+#define RX_MODE         0x51            // IRIO_RX_MODE of irs.h
+#define TRANSMIT_DICT   0x56            // IRIO_TRANSMIT_DICT of irs.h
+#define TRANSMIT_PROTO  0x50            // IRIO_TRANSMIT_PROTO of irs.h
+#define LIB_STORE       0x52            // IRIO_LIB_STORE of irs.h
+#define LIB_PLAY        0x80            // IRIO_LIB_PLAY of irs.h
+#define TX_REPEAT       0x53            // IRIO_TX_REPEAT of irs.h
+#define HANDSHAKE       0x26            // IRIO_HANDSHAKE of irs.h
+#define TX_CREDIT       0x57            // IRIO_TX_CREDIT of irs.h
+#define UNITS           0x58            // IRIO_UNITS of irs.h
+#define UNITS_TICKS     1               // IRS_UNITS_TICKS of irs.h
+#define EP2_SIZE        64
+#define RX_DECODE       1               // IRS_RX_DECODE of irs.h
+#define RX_COMPACT      3               // IRS_RX_COMPACT of irs.h
+#define UNIT_US         (64.0 / 3)      // one IRtoy time unit
+#define MAX_EDGES       4000
+#define HOST_IN_SIZE    (4 * MAX_EDGES + 64)
+#define INFO_LEN        28              // INFO_LEN of irs.h
+#define REPLAY_EDGES    1001
+#define REPLAY_SECTION  226             // a 3000/1500 us header and 112 bits
+#define REPLAY_RUNS     3               // TX in IRtoy units, TX in ticks, RX
+#define PROTO_NEC       0x01            // IRPROTO_NEC of irproto.h
+#define PROTO_RC5       0x02            // IRPROTO_RC5 of irproto.h
+#define PROTO_RC6       0x03            // IRPROTO_RC6 of irproto.h
+#define PROTO_SONY      0x04            // IRPROTO_SONY of irproto.h
+#define PROTO_SAMSUNG   0x05            // IRPROTO_SAMSUNG of irproto.h
+#define PROTO_EDGES     160             // two frames of the longest code
+#define PROTO_CARRIER_PCT 3             // the soft carrier is counted in whole pin toggles
+#define DECODE_RECORD   6               // IRPROTO_RECORD_LEN of irproto.h
+#define DECODE_AGAIN_US 250000          // a code pressed again, beyond the repeat window
+#define LIB_EDGES       125             // IRLIB_SLOT_EDGES of irlib.h, the 0xFFFF entry too
+#define LIB_SLOT        3
+#define LIB_EMPTY       4
+#define REPEAT_COUNT    2
+#define REPEAT_GAP_US   20000
+
+// a code of the protocol scenarios, with the timing of irprotoTiming in irproto.c
+struct protoCode {
+    uint8_t proto;                      // PROTO_*
+    uint16_t addr;
+    uint8_t cmd;
+};
+
+// the result of one replay run, shared with the parent process
+struct replayRun {
+    sim_time_t envelope[MAX_EDGES + 8];
+    uint16_t envelopeLen;
+    uint16_t values[MAX_EDGES];
+    uint16_t valuesLen;
+};
+
+static const char *scenario;
+static uint32_t edgeUs = 500;
+static uint16_t edges = 101;
+static double tolUs = 50;
+static bool quiet;
+static uint8_t rxMode;
+static bool txDict;
+static bool txLong;                     // extended edges, in 0.5 us ticks
+static bool ticks;                      // IRS_UNITS_TICKS, the 'u' answer came
+static bool unitsOk;
+static uint8_t txFlow;                  // 0 none, 1 handshake, 2 credits
+static const uint8_t *txPending;        // frame bytes the flow control holds back
+static uint16_t txPendingLen;
+
+static uint8_t hostIn[HOST_IN_SIZE];    // bytes the host got from the device
+static sim_time_t hostInAt[HOST_IN_SIZE];
+static uint16_t hostInLen;
+static bool sampling;                   // "S01" was answered
+static sim_time_t hostStart;            // the frame was handed to the USB host
+static sim_time_t irStart;              // the first IR receiver edge
+
+static uint16_t rxValues[MAX_EDGES];    // the values decoded from hostIn
+static uint16_t rxValuesLen;
+
+static sim_time_t envelope[MAX_EDGES + 8];
+static uint16_t envelopeLen;
+static uint32_t carrierHz;
+
+static bool replay;                     // the edges are replayUs(), not -e
+static struct replayRun *replayOut;     // where the run leaves its result
+
+static const struct protoCode protoCodes[] = {
+    {PROTO_NEC, 0x04, 0x08}, {PROTO_NEC, 0x1234, 0x56}, {PROTO_SAMSUNG, 0x07, 0x02},
+    {PROTO_RC5, 0x05, 0x35}, {PROTO_RC5, 0x1a, 0x47}, {PROTO_RC6, 0x00, 0x0c},
+    {PROTO_SONY, 0x01, 0x15}, {PROTO_SONY, 0x9a, 0x2f},
+};
+static const uint16_t protoPeriod[] = {0, 1080, 1138, 1067, 450, 1080};   // 0.1 ms
+static const uint32_t protoCarrier[] = {0, 38000, 36000, 36000, 40000, 38000};
+static uint32_t protoUs[PROTO_EDGES];   // edges of the code, the marks are the even ones
+static uint16_t protoLen;
+static uint32_t protoTotal;             // us from the first mark
+static bool protoFresh;                 // a frame starts, its leading space is dropped
+static bool protoToggle;                // RC5/RC6 toggle, the device flips it per code
+static uint8_t protoAt;                 // the code being sent
+static uint8_t protoFails;
+static double protoMaxErr;
+static double protoMaxCarrier;          // worst carrier error in percent
+
+// ===================================================================================
+// Function definitions
+// ===================================================================================
+
+static void report(const char *key, const char *fmt, double value){
+    if (quiet) return;
+    printf("%s,%s,", scenario, key);
+    printf(fmt, value);
+    putchar('\n');
+}
+
+static void onLimit(void){
+    if (!quiet) printf("%s,result,timeout\n", scenario);
+    exit(1);
+}
+
+/** @brief Remove the first bytes the host got */
+static void hostDrop(uint16_t n){
+    memmove(hostIn, hostIn + n, hostInLen - n);
+    memmove(hostInAt, hostInAt + n, (hostInLen - n) * sizeof(hostInAt[0]));
+    hostInLen -= n;
+}
+
+/** @brief Collect the IN packets, start the scenario once the device is in
+ * the sampling mode */
+static bool hostRead(const uint8_t *buf, uint8_t len){
+    uint8_t i;
+
+    for (i = 0; i < len && hostInLen < HOST_IN_SIZE; i++) {
+        hostIn[hostInLen] = buf[i];
+        hostInAt[hostInLen++] = simNow;
+    }
+    if (!sampling && hostInLen >= 3) {
+        if (memcmp(hostIn, "S01", 3)) {
+            if (!quiet) printf("%s,result,no S01\n", scenario);
+            exit(1);
+        }
+        sampling = 1;
+        hostDrop(3);
+        if (ticks) {
+            static const uint8_t cmd[] = {UNITS, UNITS_TICKS};
+            simHostWrite(cmd, sizeof(cmd));
+            return false;
+        }
+        return true;                    // just entered the sampling mode
+    }
+    if (ticks && !unitsOk && hostInLen >= 2) {
+        if (hostIn[0] != 'u' || hostIn[1] != UNITS_TICKS) {
+            if (!quiet) printf("%s,result,no u\n", scenario);
+            exit(1);
+        }
+        unitsOk = 1;
+        hostDrop(2);
+        return true;                    // the units are set too
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------------
+// Replay frame
+// -----------------------------------------------------------------------------------
+
+/** @brief Length of edge k of the replay frame in us, the marks are the even edges */
+static uint32_t replayUs(uint16_t k){
+    uint16_t j = k % REPLAY_SECTION;
+
+    if (j == 0) return 3000;
+    if (j == 1) return 1500;
+    if (!(j & 1)) return 450;
+    if (j == REPLAY_SECTION - 1) return 10000;
+    return ((k * 0x9E3779B1u) >> 31) ? 1300 : 450;     // the bits
+}
+
+/** @brief Edge k of the replay frame in IRtoy units */
+static uint16_t replayUnits(uint16_t k){
+    return (replayUs(k) * 3 + 32) / 64;
+}
+
+/** @brief Edge k of the replay frame in ticks, as the IRtoy units of the frame
+ * convert to with the remainder carried from edge to edge */
+static uint16_t replayTicks(uint16_t k){
+    uint32_t units = 0;
+    uint16_t i;
+
+    for (i = 0; i < k; i++) units += replayUnits(i);
+    return (units + replayUnits(k)) * 128 / 3 - units * 128 / 3;
+}
+
+/** @brief Time of edge k of the frame in us, from the first edge */
+static sim_time_t edgeAt(uint16_t k){
+    sim_time_t us = 0;
+
+    if (!replay) return (sim_time_t)edgeUs * k;
+    while (k--) us += replayUs(k);
+    return us;
+}
+
+// -----------------------------------------------------------------------------------
+// TX
+// -----------------------------------------------------------------------------------
+
+/** @brief The value the host sends for edge k */
+static uint16_t txUnits(uint16_t k){
+    uint16_t units;
+
+    if (replay) return ticks ? replayTicks(k) : replayUnits(k);
+    units = ticks ? edgeUs * 2 : (edgeUs * 3 + 32) / 64;
+    return units ? units : 1;
+}
+
+/** @brief The length of edge k the device should send */
+static double txEdgeUs(uint16_t k){
+    if (txLong) return edgeUs;
+    return ticks ? txUnits(k) * 0.5 : txUnits(k) * UNIT_US;
+}
+
+static void txCarrier(bool on){
+    if (!sampling || envelopeLen >= sizeof(envelope) / sizeof(envelope[0])) return;
+    if (envelopeLen == 0) {
+        simPwmToggles = 0;
+        carrierHz = simHwCarrier();
+    }
+    envelope[envelopeLen++] = simNow;
+}
+
+/** @brief The carrier of the envelope, the PWM setting or the soft PWM toggles
+ * during markUs of marks */
+static double txCarrierHz(double markUs){
+    if (!carrierHz && markUs > 0) return simPwmToggles / 2 / (markUs / 1e6);
+    return carrierHz;
+}
+
+static void txReport(char result){
+    double exact, err, maxErr = 0, sumErr = 0, markUs = 0;
+    uint16_t k, seen = envelopeLen ? envelopeLen - 1 : 0;
+
+    if (seen > edges) seen = edges;
+    for (k = 0; k < seen; k++) {
+        exact = txEdgeUs(k);
+        err = SIM_TO_US(envelope[k + 1] - envelope[k]) - exact;
+        if (!(k & 1)) markUs += exact + err;
+        sumErr += err;
+        if (err < 0) err = -err;
+        if (err > maxErr) maxErr = err;
+    }
+    carrierHz = txCarrierHz(markUs);
+
+    if (replayOut) {
+        memcpy(replayOut->envelope, envelope, sizeof(envelope));
+        replayOut->envelopeLen = envelopeLen;
+    }
+    if (!quiet) printf("%s,result,%c\n", scenario, result);
+    report("edge_us", "%.3f", txEdgeUs(0));
+    report("edges", "%.0f", edges);
+    report("seen", "%.0f", seen);
+    report("latency_us", "%.2f", envelopeLen ? SIM_TO_US(envelope[0] - hostStart) : -1);
+    report("max_error_us", "%.2f", maxErr);
+    report("mean_error_us", "%.2f", seen ? sumErr / seen : 0);
+    report("carrier_hz", "%.0f", carrierHz);
+    report("done_us", "%.2f", SIM_TO_US(simNow - hostStart));
+    report("t0_latency_us", "%.2f", SIM_TO_US(simIrqLatency[SIM_IRQ_TMR0]));
+    exit(result == 'C' && seen == edges && maxErr <= tolUs ? 0 : 1);
+}
+
+/** @brief Hand up to len bytes of the frame to the USB host */
+static void txSend(uint16_t len){
+    if (len > txPendingLen) len = txPendingLen;
+    if (len) simHostWrite(txPending, len);
+    txPending += len;
+    txPendingLen -= len;
+}
+
+/** @brief Hand the frame to the USB host, the first part of it with the flow control */
+static void txFrame(void){
+    static const uint8_t flowCmd[] = {0, HANDSHAKE, TX_CREDIT};
+    static uint8_t frame[6 * MAX_EDGES + 4];
+    uint32_t ticks = edgeUs * 2;
+    uint16_t units = txUnits(0), k, n;
+    uint8_t cmd[3];
+
+    if (txDict) {
+        // the edges and the 40 unit edge of the 0xFFFF terminator, 2 bit symbols
+        uint8_t head[] = {NOTIFY_COMPLETE, TRANSMIT_DICT, 2, units >> 8, units, 0, 40, edges + 1};
+        memcpy(frame, head, sizeof(head));
+        memset(frame + sizeof(head), 0, (edges + 4) / 4);
+        frame[sizeof(head) + edges / 4] = 0x40 >> (2 * (edges & 3));
+        simHostWrite(frame, sizeof(head) + (edges + 4) / 4);
+        hostStart = simNow;
+        return;
+    }
+    n = 0;
+    cmd[n++] = NOTIFY_COMPLETE;
+    if (txFlow) cmd[n++] = flowCmd[txFlow];
+    cmd[n++] = TRANSMIT;                // the rest of its packet is dropped
+    simHostWrite(cmd, n);
+    for (k = 0, n = 0; k < edges; k++) {
+        if (txLong) {
+            frame[n++] = 0;
+            frame[n++] = 0;
+            frame[n++] = ticks >> 24;
+            frame[n++] = ticks >> 16;
+            frame[n++] = ticks >> 8;
+            frame[n++] = ticks;
+        } else {
+            units = txUnits(k);
+            frame[n++] = units >> 8;
+            frame[n++] = units;
+        }
+    }
+    frame[n++] = 0xff;
+    frame[n++] = 0xff;
+    txPending = frame;
+    txPendingLen = n;
+    if (!txFlow) txSend(txPendingLen);
+    hostStart = simNow;
+}
+
+static void txRead(const uint8_t *buf, uint8_t len){
+    if (hostRead(buf, len)) {
+        txFrame();
+        return;
+    }
+    while (sampling && hostInLen) {
+        if (hostIn[0] == 'C' || hostIn[0] == 'F') txReport(hostIn[0]);
+        if (txFlow == 1 && hostIn[0] == EP2_SIZE) {
+            txSend(EP2_SIZE);           // one packet per handshake
+        } else if (txFlow == 2 && hostIn[0] < 0x20) {
+            txSend(hostIn[0] * EP2_SIZE);
+        } else {
+            txReport('?');
+        }
+        hostDrop(1);
+    }
+}
+
+// -----------------------------------------------------------------------------------
+// RX
+// -----------------------------------------------------------------------------------
+
+/** @brief Report the values, the terminator is at hostIn[start..end] */
+static void rxReport(uint16_t start, uint16_t end){
+    double err, maxErr = 0;
+    uint16_t k, values = rxValuesLen, last = start ? start - 1 : 0;
+
+    for (k = 0; k < values; k++) {
+        err = rxValues[k] * (ticks ? 0.5 : UNIT_US) - (edgeAt(k + 1) - edgeAt(k));
+        if (err < 0) err = -err;
+        if (err > maxErr) maxErr = err;
+    }
+    sim_time_t lastEdge = irStart + SIM_US(edgeAt(edges));
+
+    if (replayOut) {
+        memcpy(replayOut->values, rxValues, sizeof(rxValues));
+        replayOut->valuesLen = values;
+    }
+
+    if (!quiet) printf("%s,result,done\n", scenario);
+    report("edge_us", "%.0f", edgeUs);
+    report("edges", "%.0f", edges);
+    report("values", "%.0f", values);
+    report("lost", "%.0f", (double)edges - values);
+    report("bytes", "%.0f", end + 1);
+    report("max_error_us", "%.2f", maxErr);
+    report("latency_us", "%.2f", values ? SIM_TO_US(hostInAt[last] - lastEdge) : -1);
+    report("end_us", "%.2f", SIM_TO_US(hostInAt[end] - lastEdge));
+    exit(values == edges && maxErr <= tolUs ? 0 : 1);
+}
+
+/** @brief Decode the 2 byte values of the raw mode, report at the terminator */
+static void rxDecodeRaw(void){
+    uint16_t k, v;
+
+    rxValuesLen = 0;
+    for (k = 0; k + 1 < hostInLen && rxValuesLen < MAX_EDGES; k += 2) {
+        v = ((uint16_t)hostIn[k] << 8) | hostIn[k + 1];
+        if (v == 0xffff) rxReport(k, k + 1);
+        rxValues[rxValuesLen++] = v;
+    }
+}
+
+/** @brief Decode the IRS_RX_COMPACT bytes, report at the terminator */
+static void rxDecodeCompact(void){
+    uint16_t k = 0, v, n;
+
+    rxValuesLen = 0;
+    while (k < hostInLen && rxValuesLen < MAX_EDGES) {
+        if (hostIn[k] < 0x80) {
+            rxValues[rxValuesLen++] = hostIn[k++];
+        } else if (hostIn[k] == 0x80) {
+            if (k + 2 >= hostInLen) return;
+            v = ((uint16_t)hostIn[k + 1] << 8) | hostIn[k + 2];
+            if (v == 0xffff) rxReport(k, k + 2);
+            rxValues[rxValuesLen++] = v;
+            k += 3;
+        } else {
+            for (n = hostIn[k++] & 0x3f; n && rxValuesLen >= 2 && rxValuesLen + 2 <= MAX_EDGES; n--) {
+                rxValues[rxValuesLen] = rxValues[rxValuesLen - 2];
+                rxValues[rxValuesLen + 1] = rxValues[rxValuesLen - 1];
+                rxValuesLen += 2;
+            }
+        }
+    }
+}
+
+static void rxRead(const uint8_t *buf, uint8_t len){
+    uint16_t k;
+
+    if (hostRead(buf, len)) {
+        if (rxMode) {
+            uint8_t cmd[2] = {RX_MODE, rxMode};
+            simHostWrite(cmd, 2);
+        }
+        irStart = simNow + SIM_US(1000);
+        for (k = 0; k <= edges; k++) {
+            simIrEdge(irStart + SIM_US(edgeAt(k)), k & 1);
+        }
+        simLimit = irStart + SIM_US(edgeAt(edges)) + SIM_US(3000000);
+        return;
+    }
+    if (rxMode == RX_COMPACT) rxDecodeCompact();
+    else rxDecodeRaw();
+}
+
+// -----------------------------------------------------------------------------------
+// Rate search
+// -----------------------------------------------------------------------------------
+
+/** @brief Run one scenario in a child process, the child returns right away
+ * and goes on to run the scenario from main()
+ * @return 1 when it passed, 0 when it failed, -1 in the child */
+static int tryEdge(const char *name, uint32_t us){
+    pid_t pid = fork();
+    int status;
+
+    if (pid == 0) {
+        scenario = name;
+        edgeUs = us;
+        quiet = 1;
+        return -1;
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        perror("irsim");
+        exit(2);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/** @brief Binary search of the shortest edge in us that passes, lo fails
+ * @return in the child process only */
+static void rateSearch(const char *name, uint32_t lo, uint32_t hi){
+    const char *rate = scenario;
+    uint32_t mid;
+    double us;
+    int pass;
+
+    pass = tryEdge(name, hi);
+    if (pass < 0) return;
+    if (!pass) {
+        printf("%s,result,fails at %u us\n", rate, hi);
+        exit(1);
+    }
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        pass = tryEdge(name, mid);
+        if (pass < 0) return;
+        if (pass) hi = mid;
+        else lo = mid;
+    }
+    edgeUs = hi;
+    us = strcmp(name, "tx") ? hi : txEdgeUs(0);             // TX rounds to IRtoy units
+    printf("%s,min_edge_us,%.3f\n", rate, us);
+    printf("%s,edges_per_s,%.0f\n", rate, 1e6 / us);
+    exit(0);
+}
+
+// -----------------------------------------------------------------------------------
+// Replay
+// -----------------------------------------------------------------------------------
+
+/** @brief Worst cumulative error of the TX run in IRtoy units against the run in ticks */
+static double replayTxDrift(const struct replayRun *units, const struct replayRun *ref){
+    double err, maxErr = 0;
+    uint16_t k;
+
+    for (k = 1; k <= edges; k++) {
+        err = SIM_TO_US(units->envelope[k] - units->envelope[0])
+            - SIM_TO_US(ref->envelope[k] - ref->envelope[0]);
+        if (err < 0) err = -err;
+        if (err > maxErr) maxErr = err;
+    }
+    return maxErr;
+}
+
+/** @brief Worst cumulative error of the RX values against the exact edges, from
+ * the second edge, as the first value starts when INT0 starts Timer2 */
+static double replayRxDrift(const struct replayRun *run){
+    double err, maxErr = 0, sum = 0;
+    uint16_t k;
+
+    for (k = 1; k < edges; k++) {
+        sum += run->values[k] * (ticks ? 0.5 : UNIT_US);
+        err = sum - (edgeAt(k + 1) - edgeAt(1));
+        if (err < 0) err = -err;
+        if (err > maxErr) maxErr = err;
+    }
+    return maxErr;
+}
+
+/** @brief Run the replay frame through TX in IRtoy units, TX in ticks and RX,
+ * each in a child process that returns right away and goes on from main()
+ * @return in the child process only */
+static void replayRuns(void){
+    static const char *names[REPLAY_RUNS] = {"tx", "tx", "rx"};
+    struct replayRun *runs;
+    double txDrift, rxDrift;
+    bool pass = 1, rxTicks = ticks;
+    int status;
+    pid_t pid;
+    uint8_t i;
+
+    runs = mmap(NULL, REPLAY_RUNS * sizeof(*runs), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (runs == MAP_FAILED) {
+        perror("irsim");
+        exit(2);
+    }
+    for (i = 0; i < REPLAY_RUNS; i++) {
+        pid = fork();
+        if (pid == 0) {
+            scenario = names[i];
+            replay = 1;
+            replayOut = &runs[i];
+            ticks = i == 2 ? rxTicks : i == 1;
+            quiet = 1;
+            return;
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+            perror("irsim");
+            exit(2);
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) pass = 0;
+    }
+    replay = 1;
+    txDrift = runs[0].envelopeLen > edges && runs[1].envelopeLen > edges ? replayTxDrift(&runs[0], &runs[1]) : -1;
+    rxDrift = runs[2].valuesLen >= edges ? replayRxDrift(&runs[2]) : -1;
+    if (txDrift < 0 || txDrift > tolUs || rxDrift < 0 || rxDrift > tolUs) pass = 0;
+
+    if (!quiet) printf("%s,result,%s\n", scenario, pass ? "pass" : "fail");
+    report("edges", "%.0f", edges);
+    report("frame_us", "%.0f", edgeAt(edges));
+    report("tx_drift_us", "%.2f", txDrift);
+    report("rx_drift_us", "%.2f", rxDrift);
+    exit(pass ? 0 : 1);
+}
+
+// -----------------------------------------------------------------------------------
+// Protocol codes
+// -----------------------------------------------------------------------------------
+
+/** @brief Add a mark or a space to protoUs, it merges with an edge of the same
+ * level, the leading space of a frame is dropped as irprotoEmit() does */
+static void protoAdd(bool mark, uint32_t us){
+    if (protoFresh && !mark) return;
+    protoFresh = 0;
+    protoTotal += us;
+    if (protoLen && !((protoLen - 1) & 1) == mark) protoUs[protoLen - 1] += us;
+    else if (protoLen < PROTO_EDGES) protoUs[protoLen++] = us;
+}
+
+/** @brief Add one frame of the code, the NEC repeat code if repeat is set */
+static void protoFrame(const struct protoCode *c, bool repeat){
+    uint32_t code;
+    uint8_t i, bits;
+    bool one;
+
+    protoFresh = 1;
+    switch (c->proto) {
+        case PROTO_NEC:
+        case PROTO_SAMSUNG:
+            protoAdd(1, c->proto == PROTO_NEC ? 9000 : 4500);
+            if (repeat && c->proto == PROTO_NEC) {
+                protoAdd(0, 2250);
+                protoAdd(1, 560);
+                break;
+            }
+            protoAdd(0, 4500);
+            code = c->addr > 0xff ? c->addr : c->proto == PROTO_NEC
+                 ? c->addr | (uint32_t)(uint8_t)~c->addr << 8 : c->addr * 0x101u;
+            code |= (uint32_t)c->cmd << 16 | (uint32_t)(uint8_t)~c->cmd << 24;
+            for (i = 0; i < 32; i++) {
+                protoAdd(1, 560);
+                protoAdd(0, (code >> i) & 1 ? 1690 : 560);
+            }
+            protoAdd(1, 560);
+            break;
+        case PROTO_SONY:
+            bits = c->addr < 0x20 ? 12 : c->addr < 0x100 ? 15 : 20;
+            code = (c->cmd & 0x7f) | (uint32_t)c->addr << 7;
+            protoAdd(1, 2400);
+            protoAdd(0, 600);
+            for (i = 0; i < bits; i++) {
+                protoAdd(1, (code >> i) & 1 ? 1200 : 600);
+                protoAdd(0, 600);
+            }
+            break;
+        case PROTO_RC5:                 // a "1" is space-mark
+            code = 0x2000 | (c->cmd & 0x40 ? 0 : 0x1000) | protoToggle << 11
+                 | (c->addr & 0x1f) << 6 | (c->cmd & 0x3f);
+            for (i = 14; i--; ) {
+                one = (code >> i) & 1;
+                protoAdd(!one, 889);
+                protoAdd(one, 889);
+            }
+            break;
+        case PROTO_RC6:                 // a "1" is mark-space, the toggle is the trailer bit
+            code = 0x100000 | (uint32_t)protoToggle << 16 | (c->addr & 0xff) << 8 | c->cmd;
+            protoAdd(1, 2666);
+            protoAdd(0, 889);
+            for (i = 21; i--; ) {
+                one = (code >> i) & 1;
+                protoAdd(one, i == 16 ? 889 : 444);
+                protoAdd(!one, i == 16 ? 889 : 444);
+            }
+            break;
+    }
+}
+
+/** @brief The edges of a code sent with one repeat: the frame, the space up to
+ * the frame period and the repeat frame, without the final space */
+static void protoEdges(const struct protoCode *c){
+    if (c->proto == PROTO_RC5 || c->proto == PROTO_RC6) protoToggle = !protoToggle;
+    protoLen = 0;
+    protoTotal = 0;
+    protoFrame(c, 0);
+    protoAdd(0, protoPeriod[c->proto] * 100 - protoTotal);
+    protoFrame(c, 1);
+    if (!(protoLen & 1)) protoLen--;
+}
+
+/** @brief Send protocol code protoAt with one repeat */
+static void protoSend(void){
+    const struct protoCode *c = &protoCodes[protoAt];
+    uint8_t cmd[] = {NOTIFY_COMPLETE, TRANSMIT_PROTO, c->proto, c->addr >> 8, c->addr, c->cmd, 1};
+
+    protoEdges(c);
+    envelopeLen = 0;
+    simHostWrite(cmd, sizeof(cmd));
+}
+
+/** @brief Check the envelope of the code against protoUs, go on with the next one */
+static void protoCheck(char result){
+    const struct protoCode *c = &protoCodes[protoAt];
+    double err, maxErr = 0, markUs = 0;
+    uint16_t k;
+
+    for (k = 0; k < protoLen && k + 1 < envelopeLen; k++) {
+        err = SIM_TO_US(envelope[k + 1] - envelope[k]);
+        if (!(k & 1)) markUs += err;
+        err -= protoUs[k];
+        if (err < 0) err = -err;
+        if (err > maxErr) maxErr = err;
+    }
+    err = (txCarrierHz(markUs) - protoCarrier[c->proto]) * 100.0 / protoCarrier[c->proto];
+    if (err < 0) err = -err;
+    if (err > protoMaxCarrier) protoMaxCarrier = err;
+    if (maxErr > protoMaxErr) protoMaxErr = maxErr;
+    if (result != 'C' || envelopeLen != protoLen + 1 || maxErr > tolUs || err > PROTO_CARRIER_PCT) {
+        if (!quiet) printf("%s,fail,%u 0x%x 0x%x\n", scenario, c->proto, c->addr, c->cmd);
+        protoFails++;
+    }
+    if (++protoAt < sizeof(protoCodes) / sizeof(protoCodes[0])) {
+        protoSend();
+        return;
+    }
+    if (!quiet) printf("%s,result,%s\n", scenario, protoFails ? "fail" : "pass");
+    report("codes", "%.0f", protoAt);
+    report("failed", "%.0f", protoFails);
+    report("max_error_us", "%.2f", protoMaxErr);
+    report("carrier_error_pct", "%.2f", protoMaxCarrier);
+    exit(protoFails ? 1 : 0);
+}
+
+static void protoRead(const uint8_t *buf, uint8_t len){
+    if (hostRead(buf, len)) {
+        protoSend();
+        return;
+    }
+    while (sampling && hostInLen) {
+        protoCheck(hostIn[0]);
+        hostDrop(1);
+    }
+}
+
+/** @brief The IR receiver sees one frame of the code from t on
+ * @return the time of the last edge */
+static sim_time_t decodeFrame(sim_time_t t, const struct protoCode *c, bool repeat){
+    uint16_t k;
+
+    protoLen = 0;
+    protoTotal = 0;
+    protoFrame(c, repeat);
+    if (!(protoLen & 1)) protoLen--;    // the last space runs into the silence
+    for (k = 0; k < protoLen; k++) {
+        simIrEdge(t, k & 1);
+        t += SIM_US(protoUs[k]);
+    }
+    simIrEdge(t, 1);
+    return t;
+}
+
+/** @brief Check the records against the codes, three each: the frame (no flag),
+ * the frame or the NEC repeat code one period later (repeat flag) and the frame
+ * pressed again DECODE_AGAIN_US later (no flag) */
+static void decodeReport(void){
+    uint8_t i, n = sizeof(protoCodes) / sizeof(protoCodes[0]), fails = 0;
+    const struct protoCode *c;
+    const uint8_t *r;
+
+    for (i = 0; i < 3 * n; i++) {
+        c = &protoCodes[i / 3];
+        r = hostIn + i * DECODE_RECORD;
+        if ((i + 1) * DECODE_RECORD > hostInLen || r[0] != 'D' || r[1] != c->proto
+            || r[2] != c->addr >> 8 || r[3] != (uint8_t)c->addr || r[4] != c->cmd
+            || r[5] != (i % 3 == 1)) {
+            if (!quiet) printf("%s,fail,%u 0x%x 0x%x\n", scenario, c->proto, c->addr, c->cmd);
+            fails++;
+        }
+    }
+    if (hostInLen != 3 * n * DECODE_RECORD) fails++;
+    if (!quiet) printf("%s,result,%s\n", scenario, fails ? "fail" : "pass");
+    report("records", "%.0f", 3 * n);
+    report("got", "%.0f", hostInLen / DECODE_RECORD);
+    report("failed", "%.0f", fails);
+    exit(fails ? 1 : 0);
+}
+
+static void decodeRead(const uint8_t *buf, uint8_t len){
+    static const uint8_t cmd[] = {RX_MODE, RX_DECODE};
+    const struct protoCode *c;
+    sim_time_t t;
+    uint8_t i;
+
+    if (!hostRead(buf, len)) return;
+    simHostWrite(cmd, sizeof(cmd));
+    t = simNow + SIM_US(1000);
+    for (i = 0; i < sizeof(protoCodes) / sizeof(protoCodes[0]); i++) {
+        c = &protoCodes[i];
+        if (c->proto == PROTO_RC5 || c->proto == PROTO_RC6) protoToggle = !protoToggle;
+        decodeFrame(t, c, 0);
+        t += SIM_US(protoPeriod[c->proto] * 100);
+        decodeFrame(t, c, 1);
+        t += SIM_US(DECODE_AGAIN_US);
+        if (c->proto == PROTO_RC5 || c->proto == PROTO_RC6) protoToggle = !protoToggle;
+        decodeFrame(t, c, 0);
+        t += SIM_US(DECODE_AGAIN_US);
+    }
+    simLimit = t + SIM_US(1000000);
+}
+
+// -----------------------------------------------------------------------------------
+// Library
+// -----------------------------------------------------------------------------------
+
+/** @brief The frame goes out, is stored in LIB_SLOT, the empty LIB_EMPTY is played
+ * (F) and then LIB_SLOT, its envelope is reported as the one of tx */
+static void libRead(const uint8_t *buf, uint8_t len){
+    static const char answer[] = "CCF";             // the frame, the store, the empty slot
+    static const char *what[] = {"frame", "store", "empty"};
+    static uint8_t stage;
+    uint8_t cmd[] = {LIB_STORE, LIB_SLOT};
+
+    if (hostRead(buf, len)) {
+        txFrame();
+        return;
+    }
+    while (sampling && hostInLen) {
+        if (stage == 3) txReport(hostIn[0]);
+        if (hostIn[0] != answer[stage]) {
+            if (!quiet) printf("%s,result,%s %c\n", scenario, what[stage], hostIn[0]);
+            exit(1);
+        }
+        hostDrop(1);
+        switch (stage++) {
+            case 0:
+                simHostWrite(cmd, sizeof(cmd));
+                break;
+            case 1:
+                cmd[0] = LIB_PLAY | LIB_EMPTY;
+                simHostWrite(cmd, 1);
+                break;
+            case 2:
+                cmd[0] = LIB_PLAY | LIB_SLOT;
+                envelopeLen = 0;
+                simHostWrite(cmd, 1);
+                hostStart = simNow;
+                break;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------------
+// Repeat
+// -----------------------------------------------------------------------------------
+
+/** @brief The gap the host asks for, in its units */
+static uint16_t repeatGapUnits(void){
+    return ticks ? REPEAT_GAP_US * 2 : (REPEAT_GAP_US * 3 + 32) / 64;
+}
+
+/** @brief Worst error of the copies in the envelope, the edges and the gaps
+ * between the first REPEAT_COUNT + 1 copies, the gap of the last copy is the
+ * host's turnaround otherwise */
+static double repeatError(uint8_t copies, double *gapErr){
+    double gapUs = repeatGapUnits() * (ticks ? 0.5 : UNIT_US), err, maxErr = 0;
+    uint16_t at, k;
+    uint8_t c;
+
+    *gapErr = 0;
+    for (c = 0; c < copies; c++) {
+        at = c * (edges + 1);
+        if (c && c <= REPEAT_COUNT) {
+            err = SIM_TO_US(envelope[at] - envelope[at - 1]) - gapUs;
+            if (err < 0) err = -err;
+            if (err > *gapErr) *gapErr = err;
+        }
+        for (k = 0; k < edges; k++) {
+            err = SIM_TO_US(envelope[at + k + 1] - envelope[at + k]) - txEdgeUs(k);
+            if (err < 0) err = -err;
+            if (err > maxErr) maxErr = err;
+        }
+    }
+    return maxErr;
+}
+
+/** @brief The frame is sent with IRIO_TX_REPEAT right behind it, the first C
+ * must come after all the copies. Then it is repeated once more, which restarts
+ * it and is answered with a C of its own. */
+static void repeatRead(const uint8_t *buf, uint8_t len){
+    uint8_t cmd[] = {TX_REPEAT, REPEAT_COUNT, repeatGapUnits() >> 8, repeatGapUnits()};
+    uint8_t copies = REPEAT_COUNT + 1;
+    double err, gapErr;
+    static bool again;
+    bool pass;
+
+    if (hostRead(buf, len)) {
+        txFrame();
+        simHostWrite(cmd, sizeof(cmd));
+        return;
+    }
+    while (sampling && hostInLen) {
+        if (again) copies++;
+        gapErr = 0;
+        err = envelopeLen == copies * (edges + 1) ? repeatError(copies, &gapErr) : -1;
+        pass = hostIn[0] == 'C' && err >= 0 && err <= tolUs && gapErr <= tolUs;
+        if (pass && !again) {
+            hostDrop(1);
+            cmd[1] = 1;                 // once more, the frame is done
+            simHostWrite(cmd, sizeof(cmd));
+            again = 1;
+            continue;
+        }
+        if (!quiet) printf("%s,result,%s\n", scenario, pass ? "pass" : "fail");
+        report("answers", "%.0f", again + (hostIn[0] == 'C'));
+        report("copies", "%.0f", (double)envelopeLen / (edges + 1));
+        report("gap_us", "%.2f", envelopeLen > edges + 1 ? SIM_TO_US(envelope[edges + 1] - envelope[edges]) : -1);
+        report("max_error_us", "%.2f", err);
+        report("max_gap_error_us", "%.2f", gapErr);
+        exit(pass ? 0 : 1);
+    }
+}
+
+// -----------------------------------------------------------------------------------
+// Device information
+// -----------------------------------------------------------------------------------
+
+static uint32_t infoGet(uint8_t at, uint8_t n){
+    uint32_t value = 0;
+
+    while (n--) value = value << 8 | hostIn[at++];
+    return value;
+}
+
+/** @brief Decode the 'I' answer, see GetUsbIrdroidInfo() */
+static void infoRead(const uint8_t *buf, uint8_t len){
+    static const struct {
+        const char *key;
+        uint8_t at, n;
+    } fields[] = {
+        {"features", 5, 2}, {"carriers", 7, 1}, {"rx_modes", 8, 1}, {"units", 9, 1},
+        {"protocols", 10, 1}, {"tx_ring", 11, 2}, {"rx_ring", 13, 1}, {"dict_max", 14, 1},
+        {"lib_slots", 15, 1}, {"carrier_max_hz", 16, 4}, {"f_cpu", 20, 4},
+        {"xram", 24, 2}, {"tx_ring_addr", 26, 2},
+    };
+    uint8_t i;
+
+    for (i = 0; i < len && hostInLen < HOST_IN_SIZE; i++) hostIn[hostInLen++] = buf[i];
+    if (hostInLen < 2) return;
+    if (hostIn[0] != 'I' || hostIn[1] + 2 < INFO_LEN) {
+        if (!quiet) printf("%s,result,no I\n", scenario);
+        exit(1);
+    }
+    if (hostInLen < hostIn[1] + 2) return;
+    if (!quiet) printf("%s,version,%c%c%c\n", scenario, hostIn[2], hostIn[3], hostIn[4]);
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]) && !quiet; i++) {
+        printf("%s,%s,0x%lx\n", scenario, fields[i].key,
+               (unsigned long)infoGet(fields[i].at, fields[i].n));
+    }
+    exit(0);
+}
+
+static void usage(void){
+    fprintf(stderr, "usage: irsim [-e us] [-n edges] [-t us] [-u us] [-l us] [-f flow] [-d] [-x] [-k] [-r mode] [-c name=clocks] [-p] [-q] "
+                    "tx|rx|txrate|rxrate|replay|proto|decode|lib|repeat|info\n");
+    exit(2);
+}
+
+static void setCost(char *arg){
+    static const char *names[] = {"int0", "t0", "t1", "t2", "usb"};
+    char *eq = strchr(arg, '=');
+    uint32_t clocks;
+    uint8_t i;
+
+    if (!eq) usage();
+    *eq = 0;
+    clocks = strtoul(eq + 1, NULL, 0);
+    if (!strcmp(arg, "loop")) {
+        simCost.loop = clocks;
+        return;
+    }
+    if (!strcmp(arg, "entry")) {
+        simCost.entry = clocks;
+        return;
+    }
+    for (i = 0; i < SIM_IRQS; i++) {
+        if (!strcmp(arg, names[i])) {
+            simCost.isr[i] = clocks;
+            return;
+        }
+    }
+    usage();
+}
+
+int main(int argc, char *argv[]){
+    bool edgesSet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:n:t:u:l:f:r:c:dxkpq")) != -1) {
+        switch (opt) {
+            case 'e': edgeUs = strtoul(optarg, NULL, 0); break;
+            case 'n': edges = strtoul(optarg, NULL, 0) | 1; edgesSet = 1; break;
+            case 't': tolUs = strtod(optarg, NULL); break;
+            case 'u': simCost.usbSlot = SIM_US(strtoul(optarg, NULL, 0)); break;
+            case 'l': simCost.hostTurn = SIM_US(strtoul(optarg, NULL, 0)); break;
+            case 'f': txFlow = strtoul(optarg, NULL, 0); break;
+            case 'd': txDict = 1; break;
+            case 'x': txLong = 1; break;
+            case 'k': ticks = 1; break;
+            case 'r': rxMode = strtoul(optarg, NULL, 0); break;
+            case 'c': setCost(optarg); break;
+            case 'p': simFlatPrio = 1; break;
+            case 'q': quiet = 1; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || !edgeUs || edges > MAX_EDGES) usage();
+    if (txFlow > 2) usage();
+    if (txDict && edges > 4 * (64 - 8) - 1) usage();  // one EP2 OUT packet
+    if (ticks && edgeUs > 32767 && !txLong) usage();  // 16-bit ticks
+    scenario = argv[optind];
+    if (!strcmp(scenario, "replay")) {
+        if (!edgesSet) edges = REPLAY_EDGES;
+        if (txDict || txLong) usage();
+    }
+    if (!strcmp(scenario, "repeat") && (txFlow || txDict)) usage();
+    if (!strcmp(scenario, "lib")) {
+        replay = 1;
+        if (edges > LIB_EDGES || txFlow || txDict || txLong) usage();
+    }
+
+    if (!strcmp(scenario, "txrate")) rateSearch("tx", 0, 2000);
+    else if (!strcmp(scenario, "rxrate")) rateSearch("rx", 0, 2000);
+    else if (!strcmp(scenario, "replay")) replayRuns();
+
+    if (!strcmp(scenario, "tx")) {
+        simOnRead = txRead;
+        simOnCarrier = txCarrier;
+        simLimit = SIM_US(200000) + SIM_US(edgeAt(edges)) + SIM_US(1000000);
+    } else if (!strcmp(scenario, "rx")) {
+        simOnRead = rxRead;
+        simLimit = SIM_US(3000000);
+    } else if (!strcmp(scenario, "proto")) {
+        simOnRead = protoRead;
+        simOnCarrier = txCarrier;
+        simLimit = SIM_US(5000000);
+    } else if (!strcmp(scenario, "decode")) {
+        simOnRead = decodeRead;
+        simOnLimit = decodeReport;
+        simLimit = SIM_US(1000000);     // decodeRead() moves it past the last code
+    } else if (!strcmp(scenario, "lib")) {
+        simOnRead = libRead;
+        simOnCarrier = txCarrier;
+        simLimit = SIM_US(200000) + 2 * SIM_US(edgeAt(edges)) + SIM_US(1000000);
+    } else if (!strcmp(scenario, "repeat")) {
+        simOnRead = repeatRead;
+        simOnCarrier = txCarrier;
+        simLimit = SIM_US(200000) + (REPEAT_COUNT + 2) * SIM_US(edgeAt(edges) + REPEAT_GAP_US)
+                 + SIM_US(1000000);
+    } else if (!strcmp(scenario, "info")) {
+        simOnRead = infoRead;
+        simLimit = SIM_US(1000000);
+    } else {
+        usage();
+    }
+    if (!simOnLimit) simOnLimit = onLimit;
+    simHostWrite((const uint8_t *)(strcmp(scenario, "info") ? "S" : "I"), 1);
+    simStart();
+    return 0;
+}